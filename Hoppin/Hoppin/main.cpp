@@ -3,335 +3,2153 @@
 #include <vector>
 #include <string>
 #include <map>
-#include <sstream>
 #include <math.h>
 #include <thread>
 #include <chrono>
 #include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HOPPIN_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define HOPPIN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define HOPPIN_TARGET(isa)
+#endif
 
 // If Windows
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 #include <SDL2/SDL_mixer.h>
+#define NOMINMAX
+#include <windows.h>
 #else
 #include <SDL2_mixer/SDL_mixer.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 using namespace std;
 const int MAXWIDTH = 640;
 const int MAXHEIGHT = 480;
-bool endGame = false;
+const int AUDIO_RATE = 44100; // what the mixer is opened with, and what
+const int AUDIO_CHANNELS = 2; // bundled sounds are converted to
+atomic<bool> endGame(false);
+atomic<int> renderTargetResets(0); // SDL_RENDER_TARGETS_RESET events seen so far
 
-class TextureInfo
+// Every trip to the heap, from any thread, so we can check that a frame in
+// the steady state doesn't allocate at all
+atomic<long> heapAllocations(0);
+
+void *operator new(size_t size)
 {
-public:
-    SDL_Texture *texture;
-    int w, h;
-};
+    heapAllocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) throw bad_alloc();
+    return p;
+}
 
-class MediaManager
+void operator delete(void *p) noexcept
 {
-    map<string,TextureInfo *> images;
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Bump allocator for everything that lives exactly as long as one level.
+// Memory comes from a few large blocks; reset() rewinds to the first block
+// without giving anything back, so the next level reuses the same blocks
+// and a restart costs no heap traffic at all. Not thread safe: only the
+// thread building or streaming the level may allocate.
+class Arena
+{
+    static const size_t BLOCK_SIZE = 64*1024;
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+    vector<Block> blocks;
+    size_t current, offset; // block being filled and bytes used in it
 public:
-    TextureInfo *load(SDL_Renderer *ren, string imagePath)
+    Arena() { current = offset = 0; }
+    
+    ~Arena()
     {
-        if (images.count(imagePath) == 0)
-        {
-            SDL_Surface *bmp = SDL_LoadBMP(imagePath.c_str());
-            if (bmp == NULL){
-                cout << "SDL_LoadBMP Error: " << SDL_GetError()  << endl;
-                SDL_Quit();
-            }
-            else
-            {
-                cout << "Success reading " << imagePath  << endl;
-            }
-            SDL_SetColorKey(bmp,SDL_TRUE,SDL_MapRGB(bmp->format,0,255,0));
-            TextureInfo *t = new TextureInfo();
-            t->w = bmp->w;
-            t->h = bmp->h;
-            t->texture = SDL_CreateTextureFromSurface(ren, bmp);
-            SDL_FreeSurface(bmp);
-            if (t->texture == NULL)
-            {
-                cout << "SDL_CreateTextureFromSurface Error: " << SDL_GetError() << endl;
-                SDL_Quit();
-            }
-            images[imagePath] = t;
-        }
-        return images[imagePath];
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            free(blocks[i].data);
     }
     
-    void destroy(TextureInfo *t)
+    void *alloc(size_t bytes, size_t align=alignof(max_align_t))
     {
-        map<string,TextureInfo *>::iterator it;
-        for (it=images.begin(); it!=images.end(); it++)
+        for (; current < blocks.size(); current++, offset = 0)
         {
-            if (it->second == t)
+            size_t start = (offset + align - 1) & ~(align - 1);
+            if (start + bytes <= blocks[current].size)
             {
-                images.erase(it->first);
+                offset = start + bytes;
+                return blocks[current].data + start;
             }
         }
+        heapAllocations++;
+        Block b;
+        b.size = bytes > BLOCK_SIZE ? bytes : BLOCK_SIZE;
+        b.data = (char *)malloc(b.size);
+        blocks.push_back(b);
+        offset = bytes;
+        return b.data;
     }
+    
+    // Frees everything at once; nothing allocated before may be touched again
+    void reset() { current = offset = 0; }
+    
+    size_t reserved()
+    {
+        size_t total = 0;
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            total += blocks[i].size;
+        return total;
+    }
+    
+    int getBlocks() { return blocks.size(); }
 };
 
-class AnimationFrame
+Arena levelArena;
+
+// Lets standard containers draw from levelArena. Freeing is a no-op: the
+// memory comes back when the level ends.
+template <class T>
+class ArenaAllocator
 {
-    MediaManager media;
-    TextureInfo *frame;
-    int time; // ms
 public:
-    int getW() { return frame->w; }
-    int getH() { return frame->h; }
+    typedef T value_type;
+    ArenaAllocator() {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U> &) {}
+    T *allocate(size_t n) { return (T *)levelArena.alloc(n*sizeof(T), alignof(T)); }
+    void deallocate(T *, size_t) {}
+};
+template <class T, class U> bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+template <class T, class U> bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+
+template <class T> using LevelVector = vector<T, ArenaAllocator<T> >;
+
+// Fixed-size objects carved out of an arena, with a free list so objects
+// released mid-level are reused before the arena grows
+template <class T>
+class Pool
+{
+    union Slot
+    {
+        Slot *next;
+        alignas(T) char object[sizeof(T)];
+    };
+    Arena &arena;
+    Slot *freeList;
+    int live;
+public:
+    Pool(Arena &newArena) : arena(newArena)
+    {
+        freeList = NULL;
+        live = 0;
+    }
     
-    AnimationFrame(TextureInfo *newFrame, int newTime=100)
+    template <class... Args>
+    T *make(Args&&... args)
     {
-        frame = newFrame;
-        time = newTime;
+        Slot *s = freeList;
+        if (s != NULL) freeList = s->next;
+        else s = (Slot *)arena.alloc(sizeof(Slot), alignof(Slot));
+        live++;
+        return new (s->object) T(std::forward<Args>(args)...);
     }
     
-    AnimationFrame(SDL_Renderer *ren, const char *imagePath, int newTime=100)
+    void release(T *t)
     {
-        frame = media.load(ren, imagePath);
-        time = newTime;
+        t->~T();
+        Slot *s = (Slot *)t;
+        s->next = freeList;
+        freeList = s;
+        live--;
     }
     
-    void show(SDL_Renderer *ren, int x=0, int y=0)
+    // Forgets every object at once; call just before the arena is reset
+    void reset()
     {
-        SDL_Rect src,dest;
-        dest.x=x;  dest.y=y; dest.w=frame->w; dest.h=frame->h;
-        src.x=0;  src.y=0; src.w=frame->w; src.h=frame->h;
-        SDL_RenderCopy(ren, frame->texture, &src, &dest);
+        freeList = NULL;
+        live = 0;
     }
     
-    int getTime()
+    int getLive() { return live; }
+};
+
+class AtlasPage
+{
+public:
+    SDL_Texture *texture;
+    int entries; // cached images still living on this page
+};
+
+class TextureInfo
+{
+public:
+    SDL_Texture *texture;
+    AtlasPage *page; // NULL when the image has a texture of its own
+    SDL_Rect src;    // where the image sits inside texture
+    int w, h;
+    int refs; // frames currently holding this texture
+};
+
+// Shelf packer: places rectangles row by row, tallest first, onto square pages
+class TextureAtlas
+{
+    int size, padding;
+public:
+    TextureAtlas(int newSize=1024, int newPadding=1)
     {
-        return time;
+        size = newSize;
+        padding = newPadding;
     }
     
-    void destroy()
+    int getSize() { return size; }
+    
+    // Fills in x/y of every rect and the page it landed on; -1 if it can never fit
+    int pack(vector<SDL_Rect> &rects, vector<int> &pages)
     {
+        vector<int> order;
+        for (unsigned int i = 0; i < rects.size(); i++) order.push_back(i);
+        sort(order.begin(), order.end(), TallerFirst(rects));
+        pages.assign(rects.size(), -1);
+        int page = 0, x = padding, y = padding, shelfH = 0;
+        for (unsigned int i = 0; i < order.size(); i++)
+        {
+            SDL_Rect &r = rects[order[i]];
+            if (r.w + 2*padding > size || r.h + 2*padding > size) continue;
+            if (x + r.w + padding > size)
+            {
+                x = padding;
+                y += shelfH + padding;
+                shelfH = 0;
+            }
+            if (y + r.h + padding > size)
+            {
+                page++;
+                x = padding;
+                y = padding;
+                shelfH = 0;
+            }
+            r.x = x;
+            r.y = y;
+            pages[order[i]] = page;
+            x += r.w + padding;
+            if (r.h > shelfH) shelfH = r.h;
+        }
+        return order.empty() ? 0 : page + 1;
     }
+    
+private:
+    struct TallerFirst
+    {
+        const vector<SDL_Rect> &rects;
+        TallerFirst(const vector<SDL_Rect> &r) : rects(r) {}
+        bool operator()(int a, int b) const { return rects[a].h > rects[b].h; }
+    };
 };
 
-class Animation
+// Turns loaded BMP pixels into ARGB8888 with the green (0,255,0) colour
+// key already made transparent, so textures can be filled straight from
+// the result. The two layouts our BMPs come in have SIMD row kernels,
+// picked once at startup; anything else goes through SDL and a key pass.
+// Alpha stays straight (not premultiplied) to match SDL_BLENDMODE_BLEND.
+class PixelConverter
 {
-protected:
-    vector<AnimationFrame *> frames;
-    int totalTime;
-    
 public:
-    int getW()
-    {
-        if (frames.size()>0) return frames[0]->getW();
-        return 0;
-    }
+    typedef void (*BgrKernel)(const Uint8 *src, Uint32 *dst, int count);
+    typedef void (*RgbaKernel)(const Uint32 *src, Uint32 *dst, int count);
+    static BgrKernel bgrRow;   // 24-bit BMPs: bytes B,G,R
+    static RgbaKernel rgbaRow; // 32-bit BMPs with alpha: RGBA8888
+    static const char *kernelName;
+    
+    static const Uint32 KEY = 0x0000ff00; // RGB bits of the colour key
+    
+    static Uint32 keyed(Uint32 argb) { return (argb & 0x00ffffff) == KEY ? 0 : argb; }
     
-    int getH()
+    static void bgrRowScalar(const Uint8 *src, Uint32 *dst, int count)
     {
-        if (frames.size()>0) return frames[0]->getH();
-        return 0;
+        for (int i = 0; i < count; i++, src += 3)
+            dst[i] = keyed(0xff000000 | src[2] << 16 | src[1] << 8 | src[0]);
     }
     
-    Animation()
+    static void rgbaRowScalar(const Uint32 *src, Uint32 *dst, int count)
     {
-        totalTime = 0;
+        for (int i = 0; i < count; i++)
+            dst[i] = keyed(src[i] >> 8 | src[i] << 24);
     }
     
-    void addFrame(AnimationFrame *c)
+    static void keyRow(Uint32 *pixels, int count)
     {
-        frames.push_back(c);
-        totalTime += c->getTime();
+        for (int i = 0; i < count; i++)
+            pixels[i] = keyed(pixels[i]);
     }
     
-    virtual void show(SDL_Renderer *ren, int time /*ms*/, int x=0, int y=0)
+#ifdef HOPPIN_X86
+    // Four pixels a step: one shuffle spreads 12 bytes of BGR into BGRA.
+    // The 16 byte load reads past the fourth pixel, so stop short of the end.
+    HOPPIN_TARGET("ssse3")
+    static void bgrRowSSSE3(const Uint8 *src, Uint32 *dst, int count)
     {
-        int aTime = time % totalTime;
-        int tTime = 0;
-        unsigned int i = 0;
-        for (i = 0; i < frames.size(); i++)
+        const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+        const __m128i key = _mm_set1_epi32((int)(0xff000000 | KEY));
+        int i = 0;
+        for (; i + 6 <= count; i += 4)
         {
-            tTime += frames[i]->getTime();
-            if (aTime <= tTime) break;
+            __m128i px = _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 3*i)), spread), alpha);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_andnot_si128(_mm_cmpeq_epi32(px, key), px));
         }
-        frames[i]->show(ren, x, y);
+        bgrRowScalar(src + 3*i, dst + i, count - i);
     }
     
-    virtual void destroy()
+    // Eight pixels a step, as two 12 byte groups, one per 128-bit lane
+    HOPPIN_TARGET("avx2")
+    static void bgrRowAVX2(const Uint8 *src, Uint32 *dst, int count)
     {
-        for (unsigned int i = 0; i < frames.size(); i++)
-            frames[i]->destroy();
+        const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+        const __m256i key = _mm256_set1_epi32((int)(0xff000000 | KEY));
+        int i = 0;
+        for (; i + 10 <= count; i += 8)
+        {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(src + 3*i));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(src + 3*i + 12));
+            __m256i raw = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            __m256i px = _mm256_or_si256(_mm256_shuffle_epi8(raw, spread), alpha);
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_andnot_si256(_mm256_cmpeq_epi32(px, key), px));
+        }
+        bgrRowSSSE3(src + 3*i, dst + i, count - i);
     }
-};
-
-class Sprite : public Animation
-{
-public:
-    float x, dx, ax, y, dy, ay, w, h;
     
-    void set(float newX=0.0, float newY=0.0, float newDx=0.0, float newDy=0.0, float newAx=0.0, float newAy=0.0, float newW = 0.0, float newH = 0.0)
+    // RGBA to ARGB is a rotate by 8 bits, which plain SSE2 shifts can do
+    static void rgbaRowSSE2(const Uint32 *src, Uint32 *dst, int count)
     {
-        // position in pixels
-        // speed in pixels per second
-        // acceleration in pixels per second^2
-        x = newX, y = newY;
-        dx = newDx, dy = newDy;
-        ax = newAx, ay = newAy;
-        w = newW, h = newH;
+        const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+        const __m128i key = _mm_set1_epi32(KEY);
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i px = _mm_or_si128(_mm_srli_epi32(v, 8), _mm_slli_epi32(v, 24));
+            __m128i isKey = _mm_cmpeq_epi32(_mm_and_si128(px, rgb), key);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_andnot_si128(isKey, px));
+        }
+        rgbaRowScalar(src + i, dst + i, count - i);
     }
-    Sprite(float newX=0.0, float newY=0.0, float newDx=0.0, float newDy=0.0, float newAx=0.0, float newAy=0.0, float newW = 0.0, float newH = 0.0) : Animation()
+    
+    HOPPIN_TARGET("avx2")
+    static void rgbaRowAVX2(const Uint32 *src, Uint32 *dst, int count)
     {
-        set(newX, newY, newDx, newDy, newAx, newAy);
+        const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+        const __m256i key = _mm256_set1_epi32(KEY);
+        int i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i px = _mm256_or_si256(_mm256_srli_epi32(v, 8), _mm256_slli_epi32(v, 24));
+            __m256i isKey = _mm256_cmpeq_epi32(_mm256_and_si256(px, rgb), key);
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_andnot_si256(isKey, px));
+        }
+        rgbaRowSSE2(src + i, dst + i, count - i);
     }
-    void addFrames(SDL_Renderer *ren, const char *imagePath, int count, int timePerFrame=100)
+#endif
+    
+    // Picks the widest kernels this CPU runs; call once at startup
+    static void selectKernel()
     {
-        for (int i = 1; i <= count; i++)
+        bgrRow = bgrRowScalar;
+        rgbaRow = rgbaRowScalar;
+        kernelName = "scalar";
+#ifdef HOPPIN_X86
+        if (SDL_HasAVX2())
+        {
+            bgrRow = bgrRowAVX2;
+            rgbaRow = rgbaRowAVX2;
+            kernelName = "AVX2";
+        }
+        else if (SDL_HasSSSE3())
+        {
+            bgrRow = bgrRowSSSE3;
+            rgbaRow = rgbaRowSSE2;
+            kernelName = "SSSE3";
+        }
+        else if (SDL_HasSSE2())
         {
-            stringstream ss;
-            ss << imagePath << i << ".bmp";
-            addFrame(new AnimationFrame(ren, ss.str().c_str(), timePerFrame));
+            rgbaRow = rgbaRowSSE2;
+            kernelName = "SSE2";
         }
+#endif
+        cout << "Converting pixels with " << kernelName << " kernels" << endl;
     }
-    void show(SDL_Renderer *ren, int time)
+    
+    // New keyed ARGB8888 copy of src, or NULL if SDL can't convert it
+    static SDL_Surface *toArgb(SDL_Surface *src)
     {
-        Animation::show(ren, time, (int)x, (int)y);
+        Uint32 format = src->format->format;
+        if (format != SDL_PIXELFORMAT_BGR24 && format != SDL_PIXELFORMAT_RGBA8888)
+        {
+            SDL_Surface *argb = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888, 0);
+            if (argb == NULL) return NULL;
+            SDL_LockSurface(argb);
+            for (int y = 0; y < argb->h; y++)
+                keyRow((Uint32 *)((Uint8 *)argb->pixels + y*argb->pitch), argb->w);
+            SDL_UnlockSurface(argb);
+            return argb;
+        }
+        SDL_Surface *argb = SDL_CreateRGBSurfaceWithFormat(0, src->w, src->h, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (argb == NULL) return NULL;
+        SDL_LockSurface(src);
+        SDL_LockSurface(argb);
+        for (int y = 0; y < src->h; y++)
+        {
+            const Uint8 *in = (const Uint8 *)src->pixels + y*src->pitch;
+            Uint32 *out = (Uint32 *)((Uint8 *)argb->pixels + y*argb->pitch);
+            if (format == SDL_PIXELFORMAT_BGR24) bgrRow(in, out, src->w);
+            else rgbaRow((const Uint32 *)in, out, src->w);
+        }
+        SDL_UnlockSurface(argb);
+        SDL_UnlockSurface(src);
+        return argb;
     }
-    /*virtual bool side_collision(Sprite object) //Trying to get individual side collison working
-     {
-     int left, oleft;
-     int right, oright;
-     int top;
-     int obottom;
-     left = x; right = x + w;
-     top = y;
-     oleft = object.x; oright = object.x + object.w;
-     obottom = object.y + object.h;
-     return (!(top >= obottom || right <= oleft || left >= oright));
-     }
-     virtual bool bottom_collision(Sprite object)
-     {
-     int bottom = y + h;
-     int left = x;
-     int right = x + w;
-     int otop = object.y;
-     int oleft = object.x;
-     int oright = object.x + object.w;
-     if(bottom == otop) return true;
-     else return false;
-     }*/
-    virtual void update(const float &dt)
+    
+    // SDL_LoadBMP followed by toArgb
+    static SDL_Surface *loadBMP(const string &imagePath)
     {
-        x += dx*dt;
-        y += dy*dt;
-        dx += ax*dt;
-        dy += ay*dt;
+        SDL_Surface *bmp = SDL_LoadBMP(imagePath.c_str());
+        if (bmp == NULL) return NULL;
+        SDL_Surface *argb = toArgb(bmp);
+        SDL_FreeSurface(bmp);
+        return argb;
     }
 };
 
-class Game
+PixelConverter::BgrKernel PixelConverter::bgrRow = PixelConverter::bgrRowScalar;
+PixelConverter::RgbaKernel PixelConverter::rgbaRow = PixelConverter::rgbaRowScalar;
+const char *PixelConverter::kernelName = "scalar";
+
+// Read-only view of a whole file, paged in by the OS as it is touched
+class MappedFile
 {
-protected:
-    SDL_Window *win;
-    SDL_Renderer *ren;
-    int ticks;
-    float dt;
-    bool finished = false;
-    SDL_Thread *updateThread, *renderThread;
-    
+    const Uint8 *data;
+    size_t size;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+    HANDLE file, mapping;
+#endif
 public:
-    virtual void init(const char *gameName, int maxW=640, int maxH=480, int startX=100, int startY=100)
+    MappedFile()
+    {
+        data = NULL;
+        size = 0;
+    }
+    
+    ~MappedFile() { close(); }
+    
+    bool open(const char *path)
     {
-        if (SDL_Init(SDL_INIT_VIDEO) != 0)
+        close();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER length;
+        GetFileSizeEx(file, &length);
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL || length.QuadPart == 0)
         {
-            std::cout << "SDL_Init Error: " << SDL_GetError() << std::endl;
-            return;
+            if (mapping != NULL) CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
         }
-        
-        win = SDL_CreateWindow(gameName, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, maxW, maxH, SDL_WINDOW_SHOWN);
-        if (win == NULL)
+        data = (const Uint8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        size = (size_t)length.QuadPart;
+        if (data == NULL)
         {
-            std::cout << "SDL_CreateWindow Error: " << SDL_GetError() << std::endl;
-            SDL_Quit();
-            return;
+            CloseHandle(mapping);
+            CloseHandle(file);
+            size = 0;
+            return false;
         }
-        
-        ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-        if (ren == NULL)
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
         {
-            SDL_DestroyWindow(win);
-            std::cout << "SDL_CreateRenderer Error: " << SDL_GetError() << std::endl;
-            SDL_Quit();
-            return;
+            ::close(fd);
+            return false;
         }
+        void *p = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        madvise(p, info.st_size, MADV_WILLNEED); // one sequential read ahead
+        data = (const Uint8 *)p;
+        size = info.st_size;
+#endif
+        return true;
     }
     
-    virtual void done()
+    void close()
     {
-        SDL_DestroyRenderer(ren);
-        SDL_DestroyWindow(win);
-        SDL_Quit();
+        if (data == NULL) return;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap((void *)data, size);
+#endif
+        data = NULL;
+        size = 0;
     }
     
-    void renderGame()
+    const Uint8 *getData() const { return data; }
+    size_t getSize() const { return size; }
+};
+
+// Every image and sound the game uses in one file, already in the form
+// they are uploaded or played in, so a cold start is one mapping instead
+// of dozens of opens and conversions. Layout (little endian): a header,
+// the index, then each entry's bytes at a 16 byte aligned offset.
+class AssetBundle
+{
+public:
+    enum Kind { IMAGE = 1, SOUND = 2 };
+    
+    struct Header
     {
-        int start=SDL_GetTicks();
-        float frames=0.0;
-        while(!finished)
-        {
-            int ticks=SDL_GetTicks();
-            SDL_RenderClear(ren);
-            show(ticks);
-            SDL_RenderPresent(ren);
-            frames++;
-            SDL_Delay(25);
-        }
-        int end=SDL_GetTicks();
-        cout << "FPS "<< (frames*1000.0/float(end-start))<<endl;
-    }
+        char magic[4]; // "HPAK"
+        Uint32 version, count;
+    };
     
-    static int renderGame(void *self)
+    struct Entry
     {
-        cout << "Starting Render"<<endl;
-        Game *g=(Game *)self;
-        g->renderGame();
-        cout << "Done Render"<<endl;
-        return 0;
+        char name[48]; // path the loose file has, NUL padded
+        Uint32 kind;
+        Uint32 offset, size; // bytes from the start of the file
+        Sint32 w, h, pitch;  // images: PixelConverter's keyed ARGB8888
+        Sint32 freq, format, channels; // sounds: raw PCM in this spec
+    };
+    
+    static const Uint32 VERSION = 1;
+    
+private:
+    MappedFile file;
+    const Entry *entries;
+    Uint32 count;
+    
+public:
+    AssetBundle()
+    {
+        entries = NULL;
+        count = 0;
     }
     
-    void updateGame()
+    bool open(const char *path)
     {
-        int oldTicks=SDL_GetTicks();
-        while(!finished)
+        close();
+        if (!file.open(path)) return false;
+        const Header *h = (const Header *)file.getData();
+        if (file.getSize() < sizeof(Header) || memcmp(h->magic, "HPAK", 4) != 0 || h->version != VERSION
+            || sizeof(Header) + (size_t)h->count*sizeof(Entry) > file.getSize())
         {
-            int ticks=SDL_GetTicks();
-            int dticks=(ticks-oldTicks);
-            float dt=(float)(dticks)/1000.0; // s
-            update(dt);
-            oldTicks=ticks;
-            SDL_Delay(25);
+            cout << "Not a usable asset bundle: " << path << endl;
+            file.close();
+            return false;
+        }
+        entries = (const Entry *)(file.getData() + sizeof(Header));
+        count = h->count;
+        for (Uint32 i = 0; i < count; i++)
+        {
+            if ((size_t)entries[i].offset + entries[i].size > file.getSize())
+            {
+                cout << "Asset bundle is truncated: " << path << endl;
+                close();
+                return false;
+            }
         }
+        return true;
     }
     
-    static int updateGame(void *self)
+    void close()
     {
-        cout << "Starting Update"<<endl;
-        Game *g=(Game *)self;
-        g->updateGame();
-        cout << "Done Update"<<endl;
-        return 0;
+        file.close();
+        entries = NULL;
+        count = 0;
     }
     
-    virtual void run()
+    bool isOpen() const { return entries != NULL; }
+    int getCount() const { return count; }
+    
+    const Entry *find(const string &name, Kind kind) const
     {
-        finished = false;
-        int result;
-        updateThread=SDL_CreateThread(updateGame, "Update", this);
-        renderThread=SDL_CreateThread(renderGame, "Render", this);
-        while (!finished)
+        for (Uint32 i = 0; i < count; i++)
         {
-            SDL_Event event;
-            if (SDL_PollEvent(&event))
-            {
-                if (event.type == SDL_WINDOWEVENT)
+            if (entries[i].kind == (Uint32)kind && strncmp(entries[i].name, name.c_str(), sizeof(entries[i].name)) == 0)
+                return &entries[i];
+        }
+        return NULL;
+    }
+    
+    const Uint8 *data(const Entry *e) const { return file.getData() + e->offset; }
+    
+    // Offline packer: converts loose files into a bundle at path
+    static bool write(const char *path, const vector<string> &images, const vector<string> &sounds)
+    {
+        vector<Entry> index;
+        vector<vector<Uint8> > blobs;
+        for (unsigned int i = 0; i < images.size(); i++)
+        {
+            SDL_Surface *argb = PixelConverter::loadBMP(images[i]);
+            if (argb == NULL)
+            {
+                cout << "Can't pack " << images[i] << ": " << SDL_GetError() << endl;
+                return false;
+            }
+            Entry e = entry(images[i], IMAGE);
+            e.w = argb->w;
+            e.h = argb->h;
+            e.pitch = argb->w*4;
+            vector<Uint8> pixels(e.pitch*e.h);
+            SDL_LockSurface(argb);
+            for (int y = 0; y < e.h; y++)
+                memcpy(&pixels[y*e.pitch], (Uint8 *)argb->pixels + y*argb->pitch, e.pitch);
+            SDL_UnlockSurface(argb);
+            SDL_FreeSurface(argb);
+            index.push_back(e);
+            blobs.push_back(pixels);
+        }
+        for (unsigned int i = 0; i < sounds.size(); i++)
+        {
+            SDL_AudioSpec spec;
+            Uint8 *buf;
+            Uint32 len;
+            if (SDL_LoadWAV(sounds[i].c_str(), &spec, &buf, &len) == NULL)
+            {
+                cout << "Can't pack " << sounds[i] << ": " << SDL_GetError() << endl;
+                return false;
+            }
+            SDL_AudioCVT cvt;
+            SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, AUDIO_RATE);
+            vector<Uint8> pcm(len*(cvt.needed ? cvt.len_mult : 1));
+            memcpy(&pcm[0], buf, len);
+            SDL_FreeWAV(buf);
+            if (cvt.needed)
+            {
+                cvt.buf = &pcm[0];
+                cvt.len = len;
+                SDL_ConvertAudio(&cvt);
+                pcm.resize(cvt.len_cvt);
+            }
+            Entry e = entry(sounds[i], SOUND);
+            e.freq = AUDIO_RATE;
+            e.format = MIX_DEFAULT_FORMAT;
+            e.channels = AUDIO_CHANNELS;
+            index.push_back(e);
+            blobs.push_back(pcm);
+        }
+        
+        Uint32 offset = sizeof(Header) + index.size()*sizeof(Entry);
+        for (unsigned int i = 0; i < index.size(); i++)
+        {
+            offset = (offset + 15) & ~15u;
+            index[i].offset = offset;
+            index[i].size = blobs[i].size();
+            offset += index[i].size;
+        }
+        FILE *out = fopen(path, "wb");
+        if (out == NULL)
+        {
+            cout << "Can't write " << path << endl;
+            return false;
+        }
+        Header h = { { 'H', 'P', 'A', 'K' }, VERSION, (Uint32)index.size() };
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(&index[0], sizeof(Entry), index.size(), out);
+        Uint32 at = sizeof(Header) + index.size()*sizeof(Entry);
+        char zeros[16] = { 0 };
+        for (unsigned int i = 0; i < index.size(); i++)
+        {
+            fwrite(zeros, 1, index[i].offset - at, out);
+            fwrite(&blobs[i][0], 1, blobs[i].size(), out);
+            at = index[i].offset + index[i].size;
+        }
+        bool ok = ferror(out) == 0;
+        fclose(out);
+        cout << "Packed " << images.size() << " images and " << sounds.size() << " sounds into " << path << " (" << at/1024 << " KB)" << endl;
+        return ok;
+    }
+    
+private:
+    static Entry entry(const string &name, Kind kind)
+    {
+        Entry e;
+        memset(&e, 0, sizeof(e));
+        strncpy(e.name, name.c_str(), sizeof(e.name) - 1);
+        e.kind = kind;
+        return e;
+    }
+};
+
+class AssetLoader;
+
+// One image being decoded in the background. Valid until its surface has
+// been taken with wait().
+class AssetHandle
+{
+    friend class AssetLoader;
+    AssetLoader *loader;
+    void *job;
+public:
+    AssetHandle() { loader = NULL; job = NULL; }
+    bool valid() const { return job != NULL; }
+    bool ready() const;
+    // Blocks until decoded, then hands the surface (NULL on failure) to
+    // the caller, along with SDL's error message if it failed
+    SDL_Surface *wait(string *error=NULL);
+};
+
+// Decodes images on a few worker threads, so the thread that owns the
+// renderer is left with nothing but the upload. Jobs start in the order
+// they were asked for; a decoded surface waits in its job until taken.
+class AssetLoader
+{
+public:
+    typedef void (*ProgressCallback)(int done, int total, void *user);
+    
+private:
+    struct Job
+    {
+        string path, error;
+        SDL_Surface *surface;
+        bool started, done, taken;
+    };
+    vector<Job *> jobs;
+    vector<SDL_Thread *> workers;
+    SDL_mutex *lock;
+    SDL_cond *changed;
+    bool stopping;
+    int finished, reported;
+    ProgressCallback progress;
+    void *progressUser;
+    
+public:
+    AssetLoader()
+    {
+        lock = NULL;
+        changed = NULL;
+        stopping = false;
+        finished = reported = 0;
+        progress = NULL;
+        progressUser = NULL;
+    }
+    
+    ~AssetLoader() { stop(); }
+    
+    // File read, BMP parse and colour key, safe to run on any thread
+    static SDL_Surface *decode(const string &imagePath)
+    {
+        return PixelConverter::loadBMP(imagePath);
+    }
+    
+    AssetHandle request(const string &imagePath)
+    {
+        start();
+        SDL_LockMutex(lock);
+        AssetHandle h = findLocked(imagePath);
+        if (!h.valid())
+        {
+            // once every earlier job has been collected, a new batch starts
+            bool allTaken = true;
+            for (unsigned int i = 0; i < jobs.size(); i++)
+                allTaken = allTaken && jobs[i]->taken;
+            if (allTaken) forgetLocked();
+            Job *j = new Job();
+            j->path = imagePath;
+            j->surface = NULL;
+            j->started = j->done = j->taken = false;
+            jobs.push_back(j);
+            h.loader = this;
+            h.job = j;
+            SDL_CondBroadcast(changed);
+        }
+        SDL_UnlockMutex(lock);
+        return h;
+    }
+    
+    // Pending or decoded job for imagePath, if any
+    AssetHandle find(const string &imagePath)
+    {
+        if (lock == NULL) return AssetHandle();
+        SDL_LockMutex(lock);
+        AssetHandle h = findLocked(imagePath);
+        SDL_UnlockMutex(lock);
+        return h;
+    }
+    
+    // callback runs from poll(), on the thread that calls it
+    void onProgress(ProgressCallback callback, void *user)
+    {
+        progress = callback;
+        progressUser = user;
+        reported = -1;
+    }
+    
+    void poll()
+    {
+        if (lock == NULL || progress == NULL) return;
+        SDL_LockMutex(lock);
+        int done = finished, total = jobs.size();
+        SDL_UnlockMutex(lock);
+        if (done == reported) return;
+        reported = done;
+        progress(done, total, progressUser);
+    }
+    
+    // Joins the workers and drops anything nobody collected
+    void stop()
+    {
+        if (lock == NULL) return;
+        SDL_LockMutex(lock);
+        stopping = true;
+        SDL_CondBroadcast(changed);
+        SDL_UnlockMutex(lock);
+        for (unsigned int i = 0; i < workers.size(); i++)
+            SDL_WaitThread(workers[i], NULL);
+        workers.clear();
+        forgetLocked();
+        SDL_DestroyCond(changed);
+        SDL_DestroyMutex(lock);
+        changed = NULL;
+        lock = NULL;
+        stopping = false;
+    }
+    
+private:
+    friend class AssetHandle;
+    
+    void start()
+    {
+        if (lock != NULL) return;
+        lock = SDL_CreateMutex();
+        changed = SDL_CreateCond();
+        int count = max(1, min(4, SDL_GetCPUCount() - 1));
+        for (int i = 0; i < count; i++)
+            workers.push_back(SDL_CreateThread(work, "AssetLoader", this));
+    }
+    
+    AssetHandle findLocked(const string &imagePath)
+    {
+        AssetHandle h;
+        for (unsigned int i = 0; i < jobs.size(); i++)
+        {
+            if (jobs[i]->path == imagePath && !jobs[i]->taken)
+            {
+                h.loader = this;
+                h.job = jobs[i];
+            }
+        }
+        return h;
+    }
+    
+    void forgetLocked()
+    {
+        for (unsigned int i = 0; i < jobs.size(); i++)
+        {
+            if (!jobs[i]->taken) SDL_FreeSurface(jobs[i]->surface);
+            delete jobs[i];
+        }
+        jobs.clear();
+        finished = 0;
+        reported = -1;
+    }
+    
+    static int work(void *self)
+    {
+        ((AssetLoader *)self)->work();
+        return 0;
+    }
+    
+    void work()
+    {
+        SDL_LockMutex(lock);
+        while (!stopping)
+        {
+            Job *j = NULL;
+            for (unsigned int i = 0; i < jobs.size() && j == NULL; i++)
+            {
+                if (!jobs[i]->started) j = jobs[i];
+            }
+            if (j == NULL)
+            {
+                SDL_CondWait(changed, lock);
+                continue;
+            }
+            j->started = true;
+            string path = j->path;
+            SDL_UnlockMutex(lock);
+            SDL_Surface *bmp = decode(path);
+            string error = bmp == NULL ? SDL_GetError() : "";
+            SDL_LockMutex(lock);
+            j->surface = bmp;
+            j->error = error;
+            j->done = true;
+            finished++;
+            SDL_CondBroadcast(changed);
+        }
+        SDL_UnlockMutex(lock);
+    }
+    
+    bool ready(Job *j)
+    {
+        SDL_LockMutex(lock);
+        bool done = j->done;
+        SDL_UnlockMutex(lock);
+        return done;
+    }
+    
+    SDL_Surface *take(Job *j, string *error)
+    {
+        SDL_LockMutex(lock);
+        while (!j->done)
+            SDL_CondWait(changed, lock);
+        SDL_Surface *bmp = j->taken ? NULL : j->surface;
+        if (error != NULL) *error = j->error;
+        j->taken = true;
+        j->surface = NULL;
+        SDL_UnlockMutex(lock);
+        return bmp;
+    }
+};
+
+bool AssetHandle::ready() const
+{
+    return job != NULL && loader->ready((AssetLoader::Job *)job);
+}
+
+SDL_Surface *AssetHandle::wait(string *error)
+{
+    if (job == NULL) return NULL;
+    SDL_Surface *bmp = loader->take((AssetLoader::Job *)job, error);
+    job = NULL;
+    return bmp;
+}
+
+class MediaManager
+{
+    map<string,TextureInfo *> images;
+    AssetLoader loader;
+    AssetBundle bundle;
+    
+    // Takes the surface from the bundle when it holds the image (pixels
+    // stay in the mapping), else from the background loader when it has
+    // been asked for it, else decodes it right here
+    SDL_Surface *loadSurface(const string &imagePath)
+    {
+        const AssetBundle::Entry *e = bundle.find(imagePath, AssetBundle::IMAGE);
+        if (e != NULL)
+            return SDL_CreateRGBSurfaceWithFormatFrom((void *)bundle.data(e), e->w, e->h, 32, e->pitch, SDL_PIXELFORMAT_ARGB8888);
+        string error;
+        AssetHandle pending = loader.find(imagePath);
+        bool prefetched = pending.valid();
+        SDL_Surface *bmp = prefetched ? pending.wait(&error) : AssetLoader::decode(imagePath);
+        if (bmp == NULL){
+            cout << "SDL_LoadBMP Error: " << (prefetched ? error.c_str() : SDL_GetError()) << endl;
+            return NULL;
+        }
+        cout << "Success reading " << imagePath  << endl;
+        return bmp;
+    }
+    
+    void destroyImage(TextureInfo *t)
+    {
+        if (t->page == NULL)
+        {
+            SDL_DestroyTexture(t->texture);
+        }
+        else if (--t->page->entries == 0)
+        {
+            SDL_DestroyTexture(t->page->texture);
+            delete t->page;
+        }
+        delete t;
+    }
+    
+public:
+    // Later lookups try the bundle before any loose file
+    bool openBundle(const char *path)
+    {
+        if (!bundle.open(path)) return false;
+        cout << "Using asset bundle " << path << " (" << bundle.getCount() << " entries)" << endl;
+        return true;
+    }
+    
+    // Starts decoding images a later load() or pack() will want
+    void prefetch(const vector<string> &imagePaths)
+    {
+        for (unsigned int i = 0; i < imagePaths.size(); i++)
+        {
+            if (images.count(imagePaths[i]) == 0 && bundle.find(imagePaths[i], AssetBundle::IMAGE) == NULL)
+                loader.request(imagePaths[i]);
+        }
+    }
+    
+    // Bundled PCM is played in place when it matches the mixer's format
+    Mix_Chunk *loadSound(const string &soundPath)
+    {
+        const AssetBundle::Entry *e = bundle.find(soundPath, AssetBundle::SOUND);
+        int freq, channels;
+        Uint16 format;
+        if (e != NULL && Mix_QuerySpec(&freq, &format, &channels) && freq == e->freq && format == e->format && channels == e->channels)
+            return Mix_QuickLoad_RAW((Uint8 *)bundle.data(e), e->size);
+        Mix_Chunk *chunk = Mix_LoadWAV(soundPath.c_str());
+        if (chunk == NULL)
+            cout << "Mix_LoadWAV Error: " << SDL_GetError() << endl;
+        return chunk;
+    }
+    
+    AssetHandle loadAsync(const string &imagePath) { return loader.request(imagePath); }
+    
+    void onProgress(AssetLoader::ProgressCallback callback, void *user) { loader.onProgress(callback, user); }
+    void pollLoading() { loader.poll(); }
+    void stopLoading() { loader.stop(); }
+    
+    static SDL_Texture *createArgbTexture(SDL_Renderer *ren, const void *pixels, int w, int h, int pitch)
+    {
+        SDL_Texture *texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, w, h);
+        if (texture != NULL)
+        {
+            SDL_UpdateTexture(texture, NULL, pixels, pitch);
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        }
+        return texture;
+    }
+    
+    TextureInfo *load(SDL_Renderer *ren, string imagePath)
+    {
+        if (images.count(imagePath) == 0)
+        {
+            const AssetBundle::Entry *e = bundle.find(imagePath, AssetBundle::IMAGE);
+            SDL_Surface *bmp = e == NULL ? loadSurface(imagePath) : NULL;
+            if (e == NULL && bmp == NULL){
+                SDL_Quit();
+            }
+            TextureInfo *t = new TextureInfo();
+            t->w = e != NULL ? e->w : bmp->w;
+            t->h = e != NULL ? e->h : bmp->h;
+            t->src.x = 0; t->src.y = 0; t->src.w = t->w; t->src.h = t->h;
+            t->page = NULL;
+            t->refs = 0;
+            // bundle pixels and converted surfaces are both keyed ARGB8888,
+            // the texture's own format, so they upload without another pass
+            if (e != NULL)
+            {
+                t->texture = createArgbTexture(ren, bundle.data(e), t->w, t->h, e->pitch);
+            }
+            else
+            {
+                t->texture = createArgbTexture(ren, bmp->pixels, t->w, t->h, bmp->pitch);
+                SDL_FreeSurface(bmp);
+            }
+            if (t->texture == NULL)
+            {
+                cout << "SDL_CreateTexture Error: " << SDL_GetError() << endl;
+                SDL_Quit();
+            }
+            images[imagePath] = t;
+        }
+        TextureInfo *t = images[imagePath];
+        t->refs++;
+        return t;
+    }
+    
+    // Packs a set of images onto shared atlas pages so frames drawn together
+    // use the same texture; later load() calls for these paths hit the atlas.
+    void pack(SDL_Renderer *ren, const vector<string> &imagePaths)
+    {
+        vector<string> paths;
+        vector<SDL_Surface *> surfaces;
+        vector<SDL_Rect> rects;
+        for (unsigned int i = 0; i < imagePaths.size(); i++)
+        {
+            if (images.count(imagePaths[i]) != 0) continue;
+            SDL_Surface *bmp = loadSurface(imagePaths[i]);
+            if (bmp == NULL) continue;
+            SDL_Rect r = { 0, 0, bmp->w, bmp->h };
+            paths.push_back(imagePaths[i]);
+            surfaces.push_back(bmp);
+            rects.push_back(r);
+        }
+        
+        SDL_RendererInfo info;
+        int size = 1024;
+        if (SDL_GetRendererInfo(ren, &info) == 0 && info.max_texture_width > 0)
+            size = min(size, min(info.max_texture_width, info.max_texture_height));
+        TextureAtlas atlas(size);
+        vector<int> placement;
+        int pageCount = atlas.pack(rects, placement);
+        
+        for (int p = 0; p < pageCount; p++)
+        {
+            SDL_Surface *sheet = SDL_CreateRGBSurface(0, size, size, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+            if (sheet == NULL)
+            {
+                cout << "SDL_CreateRGBSurface Error: " << SDL_GetError() << endl;
+                break;
+            }
+            SDL_FillRect(sheet, NULL, 0);
+            for (unsigned int i = 0; i < surfaces.size(); i++)
+            {
+                if (placement[i] != p) continue;
+                SDL_SetSurfaceBlendMode(surfaces[i], SDL_BLENDMODE_NONE);
+                SDL_BlitSurface(surfaces[i], NULL, sheet, &rects[i]);
+            }
+            AtlasPage *page = new AtlasPage();
+            page->entries = 0;
+            page->texture = SDL_CreateTextureFromSurface(ren, sheet);
+            SDL_FreeSurface(sheet);
+            if (page->texture == NULL)
+            {
+                cout << "SDL_CreateTextureFromSurface Error: " << SDL_GetError() << endl;
+                delete page;
+                continue;
+            }
+            SDL_SetTextureBlendMode(page->texture, SDL_BLENDMODE_BLEND);
+            for (unsigned int i = 0; i < surfaces.size(); i++)
+            {
+                if (placement[i] != p) continue;
+                TextureInfo *t = new TextureInfo();
+                t->texture = page->texture;
+                t->page = page;
+                t->src = rects[i];
+                t->w = rects[i].w;
+                t->h = rects[i].h;
+                t->refs = 0;
+                page->entries++;
+                images[paths[i]] = t;
+            }
+        }
+        for (unsigned int i = 0; i < surfaces.size(); i++)
+            SDL_FreeSurface(surfaces[i]);
+        cout << "Packed " << paths.size() << " images onto " << pageCount << " atlas page(s)" << endl;
+    }
+    
+    void release(TextureInfo *t)
+    {
+        if (t == NULL || --t->refs > 0) return;
+        map<string,TextureInfo *>::iterator it;
+        for (it=images.begin(); it!=images.end(); it++)
+        {
+            if (it->second == t)
+            {
+                images.erase(it);
+                break;
+            }
+        }
+        destroyImage(t);
+    }
+    
+    // Frees whatever is still cached; must run before the renderer goes away
+    void clear()
+    {
+        map<string,TextureInfo *>::iterator it;
+        for (it=images.begin(); it!=images.end(); it++)
+        {
+            if (it->second->refs > 0)
+                cout << "Texture still referenced at shutdown: " << it->first << " (" << it->second->refs << ")" << endl;
+            destroyImage(it->second);
+        }
+        images.clear();
+    }
+};
+
+MediaManager media; // one texture cache shared by every frame in the process
+
+// Collects textured quads over a frame and submits each run that shares a
+// texture as one SDL_RenderGeometry call. Draw order is kept, so with the
+// atlas a whole frame of sprites is only a couple of calls.
+class SpriteBatch
+{
+    SDL_Texture *texture;
+    float texW, texH;
+    vector<SDL_Vertex> vertices;
+    vector<int> indices;
+    vector<SDL_Rect> srcRects, destRects; // used when SDL_RenderGeometry is unavailable
+    int drawCalls, quads;
+public:
+    SpriteBatch()
+    {
+        texture = NULL;
+        texW = texH = 1.0;
+        drawCalls = quads = 0;
+    }
+    
+    void draw(SDL_Renderer *ren, SDL_Texture *tex, const SDL_Rect &src, float x, float y, float w, float h, SDL_Color color)
+    {
+        if (tex != texture)
+        {
+            flush(ren);
+            texture = tex;
+            int tw = 1, th = 1;
+            SDL_QueryTexture(tex, NULL, NULL, &tw, &th);
+            texW = (float)tw;
+            texH = (float)th;
+        }
+#if SDL_VERSION_ATLEAST(2,0,18)
+        float u0 = src.x/texW, v0 = src.y/texH;
+        float u1 = (src.x+src.w)/texW, v1 = (src.y+src.h)/texH;
+        SDL_Vertex v;
+        v.color = color;
+        v.position.x = x;   v.position.y = y;   v.tex_coord.x = u0; v.tex_coord.y = v0; vertices.push_back(v);
+        v.position.x = x+w; v.position.y = y;   v.tex_coord.x = u1; v.tex_coord.y = v0; vertices.push_back(v);
+        v.position.x = x;   v.position.y = y+h; v.tex_coord.x = u0; v.tex_coord.y = v1; vertices.push_back(v);
+        v.position.x = x+w; v.position.y = y+h; v.tex_coord.x = u1; v.tex_coord.y = v1; vertices.push_back(v);
+#else
+        SDL_Rect dest = { (int)x, (int)y, (int)w, (int)h };
+        srcRects.push_back(src);
+        destRects.push_back(dest);
+#endif
+        quads++;
+    }
+    
+    void draw(SDL_Renderer *ren, SDL_Texture *tex, const SDL_Rect &src, float x, float y, float w, float h)
+    {
+        SDL_Color white = { 255, 255, 255, 255 };
+        draw(ren, tex, src, x, y, w, h, white);
+    }
+    
+    void flush(SDL_Renderer *ren)
+    {
+#if SDL_VERSION_ATLEAST(2,0,18)
+        if (vertices.empty())
+        {
+            texture = NULL;
+            return;
+        }
+        int count = (int)vertices.size() / 4;
+        // Index pattern is the same for every quad, so only ever grow it
+        for (int q = (int)indices.size() / 6; q < count; q++)
+        {
+            indices.push_back(q*4);   indices.push_back(q*4+1); indices.push_back(q*4+2);
+            indices.push_back(q*4+2); indices.push_back(q*4+1); indices.push_back(q*4+3);
+        }
+        SDL_RenderGeometry(ren, texture, &vertices[0], (int)vertices.size(), &indices[0], count*6);
+        vertices.clear();
+        drawCalls++;
+#else
+        for (unsigned int i = 0; i < srcRects.size(); i++)
+            SDL_RenderCopy(ren, texture, &srcRects[i], &destRects[i]);
+        drawCalls += srcRects.size();
+        srcRects.clear();
+        destRects.clear();
+#endif
+        texture = NULL;
+    }
+    
+    // Draw calls/quads since the last reset, for profiling
+    int getDrawCalls() { return drawCalls; }
+    int getQuads() { return quads; }
+    void resetStats() { drawCalls = quads = 0; }
+};
+
+SpriteBatch batch; // only touched from whichever thread is rendering
+
+class AnimationFrame
+{
+    TextureInfo *frame;
+    int time; // ms
+public:
+    int getW() { return frame->w; }
+    int getH() { return frame->h; }
+    
+    AnimationFrame(TextureInfo *newFrame, int newTime=100)
+    {
+        frame = newFrame;
+        time = newTime;
+    }
+    
+    AnimationFrame(SDL_Renderer *ren, const char *imagePath, int newTime=100)
+    {
+        frame = media.load(ren, imagePath);
+        time = newTime;
+    }
+    
+    void show(SDL_Renderer *ren, int x=0, int y=0)
+    {
+        batch.draw(ren, frame->texture, frame->src, x, y, frame->w, frame->h);
+    }
+    
+    int getTime()
+    {
+        return time;
+    }
+    
+    void destroy()
+    {
+        media.release(frame);
+        frame = NULL;
+    }
+};
+
+Pool<AnimationFrame> framePool(levelArena);
+
+class Animation
+{
+protected:
+    LevelVector<AnimationFrame *> frames;
+    LevelVector<int> ends; // ms into the loop at which each frame stops showing
+    int totalTime;
+    int frameTime; // length shared by every frame, 0 if they differ
+    
+public:
+    int getW() const
+    {
+        if (frames.size()>0) return frames[0]->getW();
+        return 0;
+    }
+    
+    int getH() const
+    {
+        if (frames.size()>0) return frames[0]->getH();
+        return 0;
+    }
+    
+    Animation()
+    {
+        totalTime = frameTime = 0;
+    }
+    
+    // An animation owns its frames, so it can be moved but never copied;
+    // pass it by reference, or hand out a SpriteState to draw it
+    Animation(const Animation &) = delete;
+    Animation &operator=(const Animation &) = delete;
+    
+    Animation(Animation &&other) : frames(std::move(other.frames)), ends(std::move(other.ends))
+    {
+        totalTime = other.totalTime;
+        frameTime = other.frameTime;
+        other.totalTime = other.frameTime = 0;
+    }
+    
+    Animation &operator=(Animation &&other)
+    {
+        frames = std::move(other.frames);
+        ends = std::move(other.ends);
+        totalTime = other.totalTime;
+        frameTime = other.frameTime;
+        other.totalTime = other.frameTime = 0;
+        return *this;
+    }
+    
+    // The timeline is built here, once, so drawing never walks the frames
+    void addFrame(AnimationFrame *c)
+    {
+        if (frames.empty()) frameTime = c->getTime();
+        else if (c->getTime() != frameTime) frameTime = 0;
+        frames.push_back(c);
+        totalTime += c->getTime();
+        ends.push_back(totalTime);
+    }
+    
+    void addFrames(SDL_Renderer *ren, const char *imagePath, int count, int timePerFrame=100)
+    {
+        char path[256];
+        for (int i = 1; i <= count; i++)
+        {
+            snprintf(path, sizeof(path), "%s%d.bmp", imagePath, i);
+            addFrame(framePool.make(ren, path, timePerFrame));
+        }
+    }
+    
+    // Frame showing at time: a division when every frame is as long as the
+    // rest, a binary search of the timeline otherwise. -1 with no frames.
+    int frameAt(int time /*ms*/) const
+    {
+        if (frames.empty()) return -1;
+        if (totalTime <= 0) return 0;
+        int aTime = time % totalTime;
+        if (aTime < 0) aTime += totalTime;
+        if (frameTime > 0) return aTime / frameTime;
+        return upper_bound(ends.begin(), ends.end(), aTime) - ends.begin();
+    }
+    
+    virtual void show(SDL_Renderer *ren, int time /*ms*/, int x=0, int y=0)
+    {
+        int i = frameAt(time);
+        if (i >= 0) frames[i]->show(ren, x, y);
+    }
+    
+    virtual void destroy()
+    {
+        for (unsigned int i = 0; i < frames.size(); i++)
+        {
+            frames[i]->destroy();
+            framePool.release(frames[i]);
+        }
+        frames.clear();
+        ends.clear();
+        totalTime = frameTime = 0;
+    }
+};
+
+Pool<Animation> animationPool(levelArena);
+
+// Every animation a level shows, each loaded once and shared by all the
+// sprites and terrain that look like it. Definitions are immutable once
+// the level is running, so the render thread reads them without locking.
+class AnimationLibrary
+{
+    vector<Animation *> defs;
+    vector<const char *> names; // image path prefix of each definition
+public:
+    // Id of the animation made from imagePath1.bmp.., loading it on first use
+    int define(SDL_Renderer *ren, const char *imagePath, int count, int timePerFrame=100)
+    {
+        for (unsigned int i = 0; i < names.size(); i++)
+        {
+            if (strcmp(names[i], imagePath) == 0) return i;
+        }
+        Animation *a = animationPool.make();
+        a->addFrames(ren, imagePath, count, timePerFrame);
+        char *name = (char *)levelArena.alloc(strlen(imagePath) + 1, 1);
+        strcpy(name, imagePath);
+        defs.push_back(a);
+        names.push_back(name);
+        return defs.size() - 1;
+    }
+    
+    Animation &get(int id) { return *defs[id]; }
+    
+    // Drops every definition; must run before the level arena is reset
+    void clear()
+    {
+        for (unsigned int i = 0; i < defs.size(); i++)
+        {
+            defs[i]->destroy();
+            animationPool.release(defs[i]);
+        }
+        defs.clear();
+        names.clear();
+    }
+};
+
+AnimationLibrary animations;
+
+// Structure-of-arrays store for everything that moves under constant
+// acceleration: one contiguous array per component, so the integration
+// pass streams through plain floats and never touches animation data.
+class KinematicsStore
+{
+public:
+    vector<float> x, y, dx, dy, ax, ay, px, py;
+    
+    typedef void (*Kernel)(KinematicsStore &k, float dt);
+    static Kernel kernel;
+    static const char *kernelName;
+    
+    int add(float newX, float newY, float newDx, float newDy, float newAx, float newAy)
+    {
+        x.push_back(newX);   y.push_back(newY);
+        px.push_back(newX);  py.push_back(newY);
+        dx.push_back(newDx); dy.push_back(newDy);
+        ax.push_back(newAx); ay.push_back(newAy);
+        return x.size() - 1;
+    }
+    
+    int size() { return x.size(); }
+    
+    void clear()
+    {
+        x.clear(); y.clear(); dx.clear(); dy.clear();
+        ax.clear(); ay.clear(); px.clear(); py.clear();
+    }
+    
+    // Advances every body by dt in one pass
+    void integrate(float dt)
+    {
+        kernel(*this, dt);
+    }
+    
+    // Explicit Euler for bodies [first, last), matching what Sprite used to do
+    void integrateRange(int first, int last, float dt)
+    {
+        for (int i = first; i < last; i++)
+        {
+            px[i] = x[i];
+            py[i] = y[i];
+            x[i] += dx[i]*dt;
+            y[i] += dy[i]*dt;
+            dx[i] += ax[i]*dt;
+            dy[i] += ay[i]*dt;
+        }
+    }
+    
+    static void integrateScalar(KinematicsStore &k, float dt)
+    {
+        k.integrateRange(0, k.size(), dt);
+    }
+    
+#ifdef HOPPIN_X86
+    static void integrateSSE(KinematicsStore &k, float dt)
+    {
+        int n = k.size(), i = 0;
+        __m128 vdt = _mm_set1_ps(dt);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(&k.x[i]), dx = _mm_loadu_ps(&k.dx[i]);
+            __m128 y = _mm_loadu_ps(&k.y[i]), dy = _mm_loadu_ps(&k.dy[i]);
+            _mm_storeu_ps(&k.px[i], x);
+            _mm_storeu_ps(&k.py[i], y);
+            _mm_storeu_ps(&k.x[i], _mm_add_ps(x, _mm_mul_ps(dx, vdt)));
+            _mm_storeu_ps(&k.y[i], _mm_add_ps(y, _mm_mul_ps(dy, vdt)));
+            _mm_storeu_ps(&k.dx[i], _mm_add_ps(dx, _mm_mul_ps(_mm_loadu_ps(&k.ax[i]), vdt)));
+            _mm_storeu_ps(&k.dy[i], _mm_add_ps(dy, _mm_mul_ps(_mm_loadu_ps(&k.ay[i]), vdt)));
+        }
+        k.integrateRange(i, n, dt);
+    }
+    
+    HOPPIN_TARGET("avx")
+    static void integrateAVX(KinematicsStore &k, float dt)
+    {
+        int n = k.size(), i = 0;
+        __m256 vdt = _mm256_set1_ps(dt);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(&k.x[i]), dx = _mm256_loadu_ps(&k.dx[i]);
+            __m256 y = _mm256_loadu_ps(&k.y[i]), dy = _mm256_loadu_ps(&k.dy[i]);
+            _mm256_storeu_ps(&k.px[i], x);
+            _mm256_storeu_ps(&k.py[i], y);
+            _mm256_storeu_ps(&k.x[i], _mm256_add_ps(x, _mm256_mul_ps(dx, vdt)));
+            _mm256_storeu_ps(&k.y[i], _mm256_add_ps(y, _mm256_mul_ps(dy, vdt)));
+            _mm256_storeu_ps(&k.dx[i], _mm256_add_ps(dx, _mm256_mul_ps(_mm256_loadu_ps(&k.ax[i]), vdt)));
+            _mm256_storeu_ps(&k.dy[i], _mm256_add_ps(dy, _mm256_mul_ps(_mm256_loadu_ps(&k.ay[i]), vdt)));
+        }
+        k.integrateRange(i, n, dt);
+    }
+#endif
+    
+    // Picks the widest kernel this CPU runs; call once at startup
+    static void selectKernel()
+    {
+        kernel = integrateScalar;
+        kernelName = "scalar";
+#ifdef HOPPIN_X86
+        if (SDL_HasAVX())
+        {
+            kernel = integrateAVX;
+            kernelName = "AVX";
+        }
+        else if (SDL_HasSSE())
+        {
+            kernel = integrateSSE;
+            kernelName = "SSE";
+        }
+#endif
+        cout << "Integrating with " << kernelName << " kernel" << endl;
+    }
+};
+
+KinematicsStore::Kernel KinematicsStore::kernel = KinematicsStore::integrateScalar;
+const char *KinematicsStore::kernelName = "scalar";
+
+KinematicsStore bodies; // positions/velocities of every Sprite in the running level
+
+// What the render thread needs to draw one sprite, copied out of the
+// simulation so the two threads never share a Sprite
+class SpriteState
+{
+public:
+    Animation *animation; // frames are never changed after init
+    int phase; // ms this copy runs ahead of the clock
+    float x, y, px, py;
+    
+    void show(SDL_Renderer *ren, int time, float alpha=1.0) const
+    {
+        animation->show(ren, time + phase, (int)(px + (x - px)*alpha), (int)(py + (y - py)*alpha));
+    }
+};
+
+// One on-screen object: which shared animation it shows and where its
+// kinematics live. Just a few ints, so sprites copy freely.
+class Sprite
+{
+    int animation; // id in animations, -1 until setAnimation()
+    int phase;     // ms this sprite's animation runs ahead of the clock
+    int body;      // index into bodies, -1 until set() is called
+public:
+    float w, h;
+    
+    // Kinematic state lives in the shared store; these are views into it
+    float &x() const { return bodies.x[body]; }
+    float &y() const { return bodies.y[body]; }
+    float &dx() const { return bodies.dx[body]; }
+    float &dy() const { return bodies.dy[body]; }
+    float &ax() const { return bodies.ax[body]; }
+    float &ay() const { return bodies.ay[body]; }
+    float &px() const { return bodies.px[body]; } // position before the last update,
+    float &py() const { return bodies.py[body]; } // for interpolated drawing
+    
+    void set(float newX=0.0, float newY=0.0, float newDx=0.0, float newDy=0.0, float newAx=0.0, float newAy=0.0, float newW = 0.0, float newH = 0.0)
+    {
+        // position in pixels
+        // speed in pixels per second
+        // acceleration in pixels per second^2
+        if (body < 0) body = bodies.add(0, 0, 0, 0, 0, 0);
+        x() = newX, y() = newY;
+        px() = newX, py() = newY;
+        dx() = newDx, dy() = newDy;
+        ax() = newAx, ay() = newAy;
+        w = newW, h = newH;
+    }
+    Sprite()
+    {
+        animation = body = -1;
+        phase = 0;
+        w = h = 0.0;
+    }
+    
+    void setAnimation(int id, int newPhase=0)
+    {
+        animation = id;
+        phase = newPhase;
+    }
+    
+    int getW() const { return animations.get(animation).getW(); }
+    int getH() const { return animations.get(animation).getH(); }
+    
+    // alpha blends from the previous update's position (0) to the latest (1)
+    void show(SDL_Renderer *ren, int time, float alpha=1.0)
+    {
+        animations.get(animation).show(ren, time + phase, (int)(px() + (x() - px())*alpha), (int)(py() + (y() - py())*alpha));
+    }
+    
+    SpriteState getState()
+    {
+        SpriteState s;
+        s.animation = &animations.get(animation);
+        s.phase = phase;
+        s.x = x(); s.y = y();
+        s.px = px(); s.py = py();
+        return s;
+    }
+    
+    // Jump somewhere without drawing the in-between positions
+    void moveTo(float newX, float newY)
+    {
+        x() = px() = newX;
+        y() = py() = newY;
+    }
+    /*virtual bool side_collision(Sprite object) //Trying to get individual side collison working
+     {
+     int left, oleft;
+     int right, oright;
+     int top;
+     int obottom;
+     left = x; right = x + w;
+     top = y;
+     oleft = object.x; oright = object.x + object.w;
+     obottom = object.y + object.h;
+     return (!(top >= obottom || right <= oleft || left >= oright));
+     }
+     virtual bool bottom_collision(Sprite object)
+     {
+     int bottom = y + h;
+     int left = x;
+     int right = x + w;
+     int otop = object.y;
+     int oleft = object.x;
+     int oright = object.x + object.w;
+     if(bottom == otop) return true;
+     else return false;
+     }*/
+    // Steps just this sprite; whole levels go through bodies.integrate()
+    void update(const float &dt)
+    {
+        bodies.integrateRange(body, body + 1, dt);
+    }
+};
+
+static_assert(is_trivially_copyable<Sprite>::value, "Sprites are plain records; frames belong to the animation library");
+
+Pool<Sprite> spritePool(levelArena); // sprites a level creates in bulk
+
+// A scenery layer that scrolls left at its own speed and wraps around.
+// Its content never changes, so it is drawn once into a texture holding
+// two copies side by side, and each frame is then a single copy of a
+// window into that texture. Without render targets the pieces are drawn
+// live instead.
+class ParallaxLayer
+{
+    struct Piece
+    {
+        Animation *animation;
+        int x, y;
+    };
+    LevelVector<Piece> pieces;
+    SDL_Texture *cache;
+    int w, top, bottom; // wrap width and the rows the pieces cover
+    float speed; // px/s
+    bool opaque; // covers every pixel, so it can skip blending
+public:
+    ParallaxLayer()
+    {
+        cache = NULL;
+        w = MAXWIDTH;
+        top = bottom = 0;
+        speed = 0;
+        opaque = false;
+    }
+    
+    void setSpeed(float newSpeed) { speed = newSpeed; }
+    
+    void add(Animation *animation, int x, int y)
+    {
+        Piece p = { animation, x, y };
+        if (pieces.empty() || y < top) top = y;
+        if (pieces.empty() || y + animation->getH() > bottom) bottom = y + animation->getH();
+        pieces.push_back(p);
+    }
+    
+    // Renders the pieces into the cache; call again if the targets are lost
+    void bake(SDL_Renderer *ren, int newW, bool newOpaque=false)
+    {
+        w = newW;
+        opaque = newOpaque;
+        if (cache != NULL) SDL_DestroyTexture(cache);
+        cache = NULL;
+        if (pieces.empty() || !SDL_RenderTargetSupported(ren)) return;
+        cache = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, 2*w, bottom - top);
+        if (cache == NULL)
+        {
+            cout << "SDL_CreateTexture Error: " << SDL_GetError() << endl;
+            return;
+        }
+        SDL_SetTextureBlendMode(cache, opaque ? SDL_BLENDMODE_NONE : SDL_BLENDMODE_BLEND);
+        batch.flush(ren);
+        SDL_SetRenderTarget(ren, cache);
+        SDL_SetRenderDrawColor(ren, 0, 0, 0, 0);
+        SDL_RenderClear(ren);
+        for (int copy = -1; copy <= 2; copy++)
+            drawPieces(ren, copy*w, -top);
+        batch.flush(ren);
+        SDL_SetRenderTarget(ren, NULL);
+        SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+    }
+    
+    void show(SDL_Renderer *ren, int ticks)
+    {
+        int shift = (int)fmod(ticks/1000.0*speed, (double)w);
+        if (cache == NULL)
+        {
+            drawPieces(ren, -shift, 0);
+            drawPieces(ren, w - shift, 0);
+            return;
+        }
+        SDL_Rect src = { shift, 0, w, bottom - top };
+        SDL_Rect dest = { 0, top, w, bottom - top };
+        batch.flush(ren);
+        SDL_RenderCopy(ren, cache, &src, &dest);
+    }
+    
+    void destroy()
+    {
+        if (cache != NULL) SDL_DestroyTexture(cache);
+        cache = NULL;
+        pieces.clear();
+    }
+    
+private:
+    void drawPieces(SDL_Renderer *ren, int dx, int dy)
+    {
+        for (unsigned int i = 0; i < pieces.size(); i++)
+            pieces[i].animation->show(ren, 0, pieces[i].x + dx, pieces[i].y + dy);
+    }
+};
+
+// Single producer, single consumer triple buffer. The writer fills its own
+// back buffer and swaps it into the middle slot; the reader swaps the
+// middle slot out only when it holds something newer. Both swaps are one
+// atomic exchange, so neither side ever waits for the other.
+template <class T>
+class TripleBuffer
+{
+    static const int INDEX = 3, FRESH = 4;
+    T buffers[3];
+    atomic<int> middle;
+    int front, back;
+public:
+    TripleBuffer() : middle(1), front(0), back(2) {}
+    
+    T &writeBuffer() { return buffers[back]; }
+    
+    void publish()
+    {
+        back = middle.exchange(back | FRESH) & INDEX;
+    }
+    
+    // Latest published value; the same one again if nothing new arrived
+    const T &read()
+    {
+        if (middle.load() & FRESH)
+            front = middle.exchange(front) & INDEX;
+        return buffers[front];
+    }
+};
+
+// Bounded single producer, single consumer queue. Each side only ever
+// writes its own index, so push and pop never lock; a full queue refuses
+// the value rather than waiting.
+template <class T, int N>
+class SpscQueue
+{
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+    T slots[N];
+    atomic<unsigned> head{0}; // next to pop, written by the consumer
+    atomic<unsigned> tail{0}; // next to push, written by the producer
+public:
+    bool push(const T &value)
+    {
+        unsigned t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == (unsigned)N) return false;
+        slots[t & (N - 1)] = value;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+    
+    bool pop(T &value)
+    {
+        unsigned h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        value = slots[h & (N - 1)];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    
+    // Only while neither side is running
+    void clear() { head = tail.load(); }
+};
+
+// An SDL event on its way from the event loop to the simulation, stamped
+// with the performance counter when the loop took it off SDL's queue
+class InputEvent
+{
+public:
+    SDL_Event event;
+    Uint64 received;
+};
+
+// Decides when the render thread starts its next frame. DISPLAY follows
+// the monitor's refresh rate, FIXED a chosen rate, and UNCAPPED never
+// waits and turns vsync off, for benchmarking. At the display rate, while
+// vsync is already holding each present to the refresh, the pacer doesn't
+// sleep on top of it; otherwise it sleeps to the deadline. Sleeps use SDL_Delay until
+// SPIN_MARGIN before the deadline, then spin on the performance counter,
+// since SDL_Delay can overshoot by a millisecond or more.
+class FramePacer
+{
+public:
+    enum Mode { DISPLAY, FIXED, UNCAPPED };
+    
+private:
+    static constexpr double SPIN_MARGIN = 0.002; // s
+    Mode mode = DISPLAY;
+    int requestedHz = 0;  // for FIXED
+    int hz = 60;          // rate in use this run
+    double freq = 1.0;    // counter ticks per s
+    Uint64 period = 0;    // ticks per frame, 0 when uncapped
+    Uint64 deadline = 0;  // when the next frame should start
+    Uint64 lastPresent = 0;
+    double presentTime = 0.0; // smoothed time spent in SDL_RenderPresent, s
+    long frames = 0;
+    double frameSum = 0.0, frameSquares = 0.0, worstFrame = 0.0; // s
+    double presentSum = 0.0;
+    
+public:
+    void configure(Mode newMode, int newHz=0)
+    {
+        mode = newMode;
+        requestedHz = newHz;
+    }
+    
+    Mode getMode() const { return mode; }
+    
+    // Rate and vsync for the coming run; call on the render thread
+    void begin(SDL_Window *win, SDL_Renderer *ren)
+    {
+        freq = (double)SDL_GetPerformanceFrequency();
+        hz = 0;
+        if (mode == FIXED) hz = requestedHz;
+        if (mode == DISPLAY)
+        {
+            SDL_DisplayMode display;
+            int index = SDL_GetWindowDisplayIndex(win);
+            if (index >= 0 && SDL_GetCurrentDisplayMode(index, &display) == 0) hz = display.refresh_rate;
+            if (hz <= 0) hz = 60; // unknown; SDL reports 0 for some displays
+        }
+        period = hz > 0 ? (Uint64)(freq/hz) : 0;
+        SDL_RenderSetVSync(ren, mode == UNCAPPED ? 0 : 1);
+        deadline = lastPresent = SDL_GetPerformanceCounter();
+        presentTime = 0.0;
+        frames = 0;
+        frameSum = frameSquares = worstFrame = presentSum = 0.0;
+    }
+    
+    // SDL_RenderPresent, timed; the gap between presents is the frame time
+    void present(SDL_Renderer *ren)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        SDL_RenderPresent(ren);
+        Uint64 end = SDL_GetPerformanceCounter();
+        double took = (end - start)/freq;
+        presentTime += (took - presentTime)*0.1;
+        presentSum += took;
+        double frame = (end - lastPresent)/freq;
+        lastPresent = end;
+        if (frames++ == 0) return; // the first gap includes the scene's setup
+        frameSum += frame;
+        frameSquares += frame*frame;
+        worstFrame = max(worstFrame, frame);
+    }
+    
+    // Holds the render thread until the next frame is due
+    void wait()
+    {
+        if (period == 0) return;
+        deadline += period;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now > deadline + period) deadline = now; // a long miss: don't try to catch up
+        if (mode == DISPLAY && presentTime > 0.5*period/freq) return; // vsync is already pacing us
+        sleepUntil(deadline);
+    }
+    
+    static void sleepUntil(Uint64 deadline)
+    {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline) return;
+        double left = (deadline - now)/freq;
+        if (left > SPIN_MARGIN) SDL_Delay((Uint32)((left - SPIN_MARGIN)*1000.0));
+        while (SDL_GetPerformanceCounter() < deadline)
+            this_thread::yield();
+    }
+    
+    void report()
+    {
+        const char *names[] = { "display", "fixed", "uncapped" };
+        cout << "Pacing " << names[mode];
+        if (hz > 0) cout << " at " << hz << " Hz";
+        cout << endl;
+        long n = frames - 1;
+        if (n <= 0) return;
+        double mean = frameSum/n;
+        double jitter = sqrt(max(0.0, frameSquares/n - mean*mean));
+        cout << "Frame time " << (mean*1000.0) << " ms, jitter " << (jitter*1000.0) << " ms, worst " << (worstFrame*1000.0)
+             << " ms, present " << (presentSum*1000.0/frames) << " ms" << endl;
+    }
+};
+
+// A scene: loaded by the engine the first time it is played, then only
+// reset before each further run, and torn down once at shutdown
+class Game
+{
+protected:
+    SDL_Window *win = NULL;   // both belong to the engine
+    SDL_Renderer *ren = NULL;
+    int ticks;
+    float dt;
+    atomic<bool> finished{false};
+    SDL_Thread *updateThread, *renderThread;
+    int tickRate = 60;          // simulation steps per second
+    int maxCatchUpSteps = 5;    // beyond this, lost time is dropped rather than simulated
+    atomic<Uint64> lastTick;    // performance counter the latest simulated state belongs to
+    FramePacer pacer;           // render thread only, once running
+    SpscQueue<InputEvent, 64> input; // event loop to update thread
+    long inputDropped = 0;      // event loop only: queue was full
+    long inputHandled = 0;      // update thread only, with the time
+    double inputQueued = 0.0;   // those events spent queued, s
+    
+public:
+    virtual ~Game() {}
+    
+    void attach(SDL_Window *newWin, SDL_Renderer *newRen)
+    {
+        win = newWin;
+        ren = newRen;
+    }
+    
+    // Once, the first time the scene is played: textures, sounds, layers
+    virtual void init() {}
+    
+    // Before every run: back to the starting state, nothing reloaded
+    virtual void reset() {}
+    
+    // Once, at shutdown, while the renderer is still alive
+    virtual void done() {}
+    
+    void renderGame()
+    {
+        int start=SDL_GetTicks();
+        float frames=0.0;
+        const int warmUp = 30; // frames for buffers to reach their working size
+        long warmAllocations = 0;
+        batch.resetStats();
+        pacer.begin(win, ren);
+        while(!finished)
+        {
+            int ticks=SDL_GetTicks();
+            SDL_RenderClear(ren);
+            show(ticks, interpolation(lastTick));
+            batch.flush(ren);
+            pacer.present(ren);
+            frames++;
+            if (frames == warmUp) warmAllocations = heapAllocations;
+            pacer.wait();
+        }
+        if (pacer.getMode() == FramePacer::UNCAPPED) SDL_RenderSetVSync(ren, 1); // scenes after this one expect it
+        int end=SDL_GetTicks();
+        cout << "FPS "<< (frames*1000.0/float(end-start))<<endl;
+        if (frames > 0)
+            cout << "Draw calls/frame " << (batch.getDrawCalls()/frames) << ", sprites/frame " << (batch.getQuads()/frames) << endl;
+        if (frames > warmUp)
+            cout << "Heap allocations/frame after warm-up " << ((heapAllocations - warmAllocations)/(frames - warmUp)) << endl;
+        pacer.report();
+    }
+    
+    static int renderGame(void *self)
+    {
+        cout << "Starting Render"<<endl;
+        Game *g=(Game *)self;
+        g->renderGame();
+        cout << "Done Render"<<endl;
+        return 0;
+    }
+    
+    void setTickRate(int hz)
+    {
+        if (hz > 0) tickRate = hz;
+    }
+    
+    // Takes effect from the next run
+    void setFrameRate(FramePacer::Mode mode, int hz=0)
+    {
+        if (mode == FramePacer::FIXED && hz <= 0) mode = FramePacer::DISPLAY;
+        pacer.configure(mode, hz);
+    }
+    
+    // Fixed-step simulation: real time is banked and spent in whole ticks of
+    // 1/tickRate s, so physics is the same whatever the frame rate
+    void updateGame()
+    {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        double step = 1.0/tickRate; // s
+        double accumulator = 0.0;
+        Uint64 oldCounter = SDL_GetPerformanceCounter();
+        lastTick = oldCounter;
+        while(!finished)
+        {
+            Uint64 counter = SDL_GetPerformanceCounter();
+            accumulator += (counter - oldCounter)/freq;
+            oldCounter = counter;
+            if (accumulator > maxCatchUpSteps*step) accumulator = maxCatchUpSteps*step;
+            handleInput(counter, freq);
+            int steps = 0;
+            while (accumulator >= step && !finished)
+            {
+                update((float)step);
+                accumulator -= step;
+                steps++;
+            }
+            lastTick = counter - (Uint64)(accumulator*freq);
+            if (steps > 0) publish(lastTick);
+            if (accumulator < step && !finished)
+                FramePacer::sleepUntil(counter + (Uint64)((step - accumulator)*freq));
+        }
+    }
+    
+    // Input reaches the scene here, on the update thread, just before the
+    // ticks it affects, so handleEvent never races the simulation
+    void handleInput(Uint64 now, double freq)
+    {
+        InputEvent e;
+        while (input.pop(e))
+        {
+            handleEvent(e.event);
+            inputHandled++;
+            if (now > e.received) inputQueued += (now - e.received)/freq;
+        }
+    }
+    
+    // Ends the run from any thread; the event is only there to wake the
+    // event loop, which would otherwise notice on its next timeout
+    void finish()
+    {
+        finished = true;
+        SDL_Event wake;
+        memset(&wake, 0, sizeof(wake));
+        wake.type = SDL_USEREVENT;
+        SDL_PushEvent(&wake);
+    }
+    
+    // How far the render thread is past the state simulated at counter tick,
+    // as a fraction of a tick
+    float interpolation(Uint64 tick)
+    {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now < tick) return 0.0f;
+        double elapsed = (now - tick)/(double)SDL_GetPerformanceFrequency();
+        float alpha = (float)(elapsed*tickRate);
+        return alpha > 1.0f ? 1.0f : alpha;
+    }
+    
+    static int updateGame(void *self)
+    {
+        cout << "Starting Update"<<endl;
+        Game *g=(Game *)self;
+        g->updateGame();
+        cout << "Done Update"<<endl;
+        return 0;
+    }
+    
+    // The event loop sleeps in SDL until something happens; everything that
+    // isn't for the loop itself is queued for the update thread
+    virtual void run()
+    {
+        finished = false;
+        int result;
+        input.clear();
+        inputDropped = inputHandled = 0;
+        inputQueued = 0.0;
+        lastTick = SDL_GetPerformanceCounter();
+        updateThread=SDL_CreateThread(updateGame, "Update", this);
+        renderThread=SDL_CreateThread(renderGame, "Render", this);
+        while (!finished)
+        {
+            SDL_Event event;
+            if (SDL_WaitEventTimeout(&event, 100))
+            {
+                InputEvent e;
+                e.received = SDL_GetPerformanceCounter();
+                e.event = event;
+                if (event.type == SDL_RENDER_TARGETS_RESET) renderTargetResets++;
+                if (event.type == SDL_WINDOWEVENT)
                 {
                     if (event.window.event == SDL_WINDOWEVENT_CLOSE)
                     {
@@ -347,85 +2165,557 @@ public:
                         endGame = true;
                     }
                 }
-                if (!finished) handleEvent(event);
+                if (!finished && event.type != SDL_USEREVENT && !input.push(e)) inputDropped++;
             }
-                        ticks = SDL_GetTicks();
+            ticks = SDL_GetTicks();
         }
         SDL_WaitThread(renderThread, &result);
         SDL_WaitThread(updateThread, &result);
+        if (inputHandled > 0)
+            cout << "Input events " << inputHandled << ", queued " << (inputQueued*1000.0/inputHandled) << " ms on average" << endl;
+        if (inputDropped > 0)
+            cout << "Input events dropped " << inputDropped << endl;
     }
     virtual void update(float dt) = 0;
-    virtual void show(int ticks) = 0;
+    // Called on the update thread after each batch of ticks, with the
+    // counter value the new state belongs to
+    virtual void publish(Uint64 tick) {}
+    virtual void show(int ticks, float alpha=1.0) = 0;
     virtual void handleEvent(SDL_Event &event) = 0;
 };
 
-class StartGame:public Game
+class StartGame:public Game
+{
+    Animation background;
+    int loaded = 0, toLoad = 0; // level images decoded in the background
+public:
+    void init()
+    {
+        background.addFrame(framePool.make(ren, "Img/startscreen1.bmp", 500));
+        background.addFrame(framePool.make(ren, "Img/startscreen2.bmp", 1000));
+    }
+    
+    static void loadingProgress(int done, int total, void *self)
+    {
+        StartGame *g = (StartGame *)self;
+        g->loaded = done;
+        g->toLoad = total;
+    }
+    
+    // Thin bar along the bottom while the level is still loading
+    void showProgress()
+    {
+        if (toLoad == 0 || loaded >= toLoad) return;
+        SDL_Rect bar = { 20, MAXHEIGHT - 20, (MAXWIDTH - 40)*loaded/toLoad, 6 };
+        SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
+        SDL_RenderFillRect(ren, &bar);
+        SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+    }
+    
+    // One thread: waits for events until the next frame is due, so the
+    // screen redraws at FRAME_MS instead of as fast as the loop can spin
+    void run()
+    {
+        const int FRAME_MS = 16;
+        int start = SDL_GetTicks();
+        int oldTicks = start;
+        int nextFrame = start;
+        float frames = 0.0;
+        finished = false;
+        media.onProgress(loadingProgress, this);
+        while (!finished)
+        {
+            SDL_Event event;
+            int wait = nextFrame - (int)SDL_GetTicks();
+            if (SDL_WaitEventTimeout(&event, wait > 0 ? wait : 0))
+            {
+                if (event.type == SDL_RENDER_TARGETS_RESET) renderTargetResets++;
+                if (event.type == SDL_WINDOWEVENT)
+                {
+                    if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+                    {
+                        finished = true;
+                        endGame = true;
+                    }
+                }
+                if (event.type == SDL_KEYDOWN)
+                {
+                    finished = true;
+                    if (event.key.keysym.sym == SDLK_ESCAPE)
+                    {
+                        endGame = true;
+                    }
+                }
+                if (!finished) handleEvent(event);
+            }
+            ticks = SDL_GetTicks();
+            if (finished || ticks - nextFrame < 0) continue;
+            nextFrame = max(nextFrame + FRAME_MS, ticks);
+            dt = (float) (ticks-oldTicks)/1000.0; // s
+            oldTicks = ticks;
+            SDL_RenderClear(ren);
+            show(ticks);
+            batch.flush(ren);
+            media.pollLoading();
+            showProgress();
+            SDL_RenderPresent(ren);
+            frames++;
+        }
+        media.onProgress(NULL, NULL);
+        int end = SDL_GetTicks();
+        if (end > start)
+            cout << "FPS: " << (frames*1000.0/float(end-start)) << endl;
+    }
+    
+    void show(int ticks, float alpha=1.0)
+    {
+        background.show(ren, ticks);
+    }
+    
+    void update(float dt)
+    {
+    }
+    
+    void handleEvent(SDL_Event &event)
+    {
+    }
+    
+    void done()
+    {
+        background.destroy();
+        Game::done();
+    }
+};
+
+// Objects the camera test let through vs. skipped, summed over frames
+class CullStats
+{
+public:
+    long drawn, culled, frames;
+    CullStats() { reset(); }
+    void reset() { drawn = culled = frames = 0; }
+    void count(int total, int visible)
+    {
+        drawn += visible;
+        culled += total - visible;
+    }
+};
+
+// Uniform grid of fixed-width columns along X. Each object is filed under
+// the column holding its left edge; queries widen to the left by the widest
+// object so nothing is missed and nothing is returned twice. Positions are
+// in the grid's own frame, so a layer that scrolls as a whole only needs
+// its offset subtracted, never a rebuild.
+class SpatialGrid
+{
+    float cellSize, widest;
+    LevelVector<LevelVector<int> > cells;
+public:
+    SpatialGrid(float newCellSize=50.0)
+    {
+        cellSize = newCellSize;
+        widest = 0;
+    }
+    
+    // Empties every column but keeps their storage for the next fill
+    void clear()
+    {
+        for (unsigned int i = 0; i < cells.size(); i++)
+            cells[i].clear();
+        widest = 0;
+    }
+    
+    void insert(int id, float x, float w)
+    {
+        int c = (int)floor(x / cellSize);
+        if (c < 0) c = 0;
+        if (c >= (int)cells.size()) cells.resize(c + 1);
+        cells[c].push_back(id);
+        if (w > widest) widest = w;
+    }
+    
+    // Appends ids of objects whose left edge could put them in [minX,maxX]
+    void query(float minX, float maxX, LevelVector<int> &out)
+    {
+        int first = (int)floor((minX - widest) / cellSize);
+        int last = (int)floor(maxX / cellSize);
+        if (first < 0) first = 0;
+        if (last >= (int)cells.size()) last = cells.size() - 1;
+        for (int c = first; c <= last; c++)
+            out.insert(out.end(), cells[c].begin(), cells[c].end());
+    }
+};
+
+// Sort-and-sweep broadphase along X for sprites that move independently.
+// The endpoint list is kept from tick to tick and re-sorted with insertion
+// sort, which is close to linear because objects barely change order.
+class SweepAndPrune
+{
+    struct Entry
+    {
+        Sprite *sprite;
+        float minX, maxX;
+    };
+    LevelVector<Entry> entries;
+    LevelVector<pair<Sprite *, Sprite *> > pairs;
+public:
+    void clear()
+    {
+        entries.clear();
+        pairs.clear();
+    }
+    
+    void add(Sprite *s)
+    {
+        Entry e;
+        e.sprite = s;
+        e.minX = s->x();
+        e.maxX = s->x() + s->getW();
+        entries.push_back(e);
+    }
+    
+    void remove(Sprite *s)
+    {
+        for (unsigned int i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].sprite == s)
+            {
+                entries.erase(entries.begin() + i);
+                return;
+            }
+        }
+    }
+    
+    // Refreshes bounds from the sprites, restores X order and rebuilds the
+    // list of pairs whose boxes overlap
+    void update()
+    {
+        for (unsigned int i = 0; i < entries.size(); i++)
+        {
+            entries[i].minX = entries[i].sprite->x();
+            entries[i].maxX = entries[i].sprite->x() + entries[i].sprite->getW();
+        }
+        for (unsigned int i = 1; i < entries.size(); i++)
+        {
+            Entry e = entries[i];
+            int j = i - 1;
+            while (j >= 0 && entries[j].minX > e.minX)
+            {
+                entries[j+1] = entries[j];
+                j--;
+            }
+            entries[j+1] = e;
+        }
+        pairs.clear();
+        for (unsigned int i = 0; i < entries.size(); i++)
+        {
+            Sprite *a = entries[i].sprite;
+            for (unsigned int j = i + 1; j < entries.size() && entries[j].minX < entries[i].maxX; j++)
+            {
+                Sprite *b = entries[j].sprite;
+                if (a->y() < b->y() + b->getH() && b->y() < a->y() + a->getH())
+                    pairs.push_back(make_pair(a, b));
+            }
+        }
+    }
+    
+    const LevelVector<pair<Sprite *, Sprite *> > &getPairs() { return pairs; }
+};
+
+// A piece of level geometry. Terrain never moves in world space, so it is
+// plain read-only data sharing one Animation per kind; the camera scrolls.
+class Terrain
+{
+public:
+    Animation *animation;
+    float x, y; // world space
+    int w, h;
+    
+    Terrain(Animation *newAnimation, float newX, float newY)
+    {
+        animation = newAnimation;
+        x = newX;
+        y = newY;
+        w = newAnimation->getW();
+        h = newAnimation->getH();
+    }
+    
+    // Screen-space state for a camera that moved from prevCameraX to cameraX
+    SpriteState getState(float cameraX, float prevCameraX) const
+    {
+        SpriteState s;
+        s.animation = animation;
+        s.phase = 0;
+        s.x = x - cameraX;
+        s.px = x - prevCameraX;
+        s.y = s.py = y;
+        return s;
+    }
+};
+
+// Small xorshift generator, so a seed always builds the same level
+class Random
+{
+    Uint32 state;
+public:
+    Random(Uint32 seed=1) { reseed(seed); }
+    void reseed(Uint32 seed) { state = seed ? seed : 0x9e3779b9; }
+    Uint32 next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    int range(int n) { return next() % n; }
+};
+
+// One screen-and-a-bit of level. Pieces are kept in left-to-right order and
+// indexed in chunk-local grids; the vectors keep their capacity when the
+// chunk is recycled, so streaming doesn't allocate once warmed up.
+class LevelChunk
+{
+public:
+    static const int COLUMNS = 16;
+    static const int COLUMN_W = 50;
+    int index;  // position in the level, -1 while unused
+    float left; // world x of the first column
+    bool solid[COLUMNS]; // floor blueprint: false is a pit
+    LevelVector<Terrain> bricks, spikes, jumpBlocks;
+    SpatialGrid brickGrid, spikeGrid, blockGrid;
+    
+    LevelChunk() { index = -1; left = 0; }
+    
+    static float width() { return COLUMNS*COLUMN_W; }
+    
+    void clear()
+    {
+        bricks.clear();
+        spikes.clear();
+        jumpBlocks.clear();
+        brickGrid.clear();
+        spikeGrid.clear();
+        blockGrid.clear();
+    }
+};
+
+// One chunk's floor as the render thread sees it: which columns are
+// solid and where the strip is on screen now and at the previous tick
+class StripState
+{
+public:
+    int chunk; // level index, names the strip in the cache
+    bool solid[LevelChunk::COLUMNS];
+    float x, px, y;
+};
+
+// Render-side copy of a level tick: sprites in draw order, already culled
+class WorldSnapshot
+{
+public:
+    Uint64 tick;
+    LevelVector<StripState> strips;
+    LevelVector<SpriteState> sprites;
+    WorldSnapshot() { tick = 0; }
+};
+
+// Floor tiles baked a chunk at a time into strip textures, so the whole
+// floor is a copy or two per frame instead of a quad per brick. Only used
+// on the render thread; a strip is baked when a chunk it hasn't seen
+// scrolls in, into whichever slot has gone unused longest.
+class TileStrips
 {
-    Animation background;
+    static const int SLOTS = 4; // more than can ever be on screen at once
+    SDL_Texture *textures[SLOTS];
+    int chunks[SLOTS];   // level index baked into each slot, -1 if none
+    long lastUsed[SLOTS];
+    long frame;
+    Animation *tile;
+    bool baking; // false once render targets turn out to be missing
 public:
-    void init(const char *gameName = "Hoppin", int maxW=MAXWIDTH, int maxH=MAXHEIGHT, int startX=100, int startY=100)
+    int bakes;
+    
+    TileStrips()
     {
-        Game::init(gameName);
-        background.addFrame(new AnimationFrame(ren, "Img/startscreen1.bmp", 500));
-        background.addFrame(new AnimationFrame(ren, "Img/startscreen2.bmp", 1000));
+        for (int i = 0; i < SLOTS; i++)
+            textures[i] = NULL;
+        tile = NULL;
+        baking = false;
+        reset();
     }
     
-    void run()
+    // Makes every slot's texture up front so scrolling never has to
+    void create(SDL_Renderer *ren, Animation *newTile)
     {
-        int start = SDL_GetTicks();
-        int oldTicks = start;
-        finished = false;
-        while (!finished)
+        tile = newTile;
+        baking = SDL_RenderTargetSupported(ren);
+        for (int i = 0; i < SLOTS && baking; i++)
         {
-            SDL_Event event;
-            if (SDL_PollEvent(&event))
+            textures[i] = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, (int)LevelChunk::width(), tile->getH());
+            if (textures[i] == NULL)
             {
-                if (event.type == SDL_WINDOWEVENT)
-                {
-                    if (event.window.event == SDL_WINDOWEVENT_CLOSE)
-                    {
-                        finished = true;
-                        endGame = true;
-                    }
-                }
-                if (event.type == SDL_KEYDOWN)
-                {
-                    finished = true;
-                    if (event.key.keysym.sym == SDLK_ESCAPE)
-                    {
-                        endGame = true;
-                    }
-                }
-                if (!finished) handleEvent(event);
+                cout << "SDL_CreateTexture Error: " << SDL_GetError() << endl;
+                baking = false;
             }
-            ticks = SDL_GetTicks();
-            dt = (float) (ticks-oldTicks)/1000.0; // s
-            oldTicks = ticks;
-            SDL_RenderClear(ren);
-            show(ticks);
-            SDL_RenderPresent(ren);
+            else SDL_SetTextureBlendMode(textures[i], SDL_BLENDMODE_BLEND);
         }
-        int end = SDL_GetTicks();
-        cout << "FPS: " << (300.0*1000.0/float(end-start)) << endl;
+        reset();
     }
     
-    void show(int ticks)
+    // Forget what every slot holds, e.g. after the targets were lost
+    void reset()
     {
-        background.show(ren, ticks);
+        for (int i = 0; i < SLOTS; i++)
+        {
+            chunks[i] = -1;
+            lastUsed[i] = 0;
+        }
+        frame = 0;
+        bakes = 0;
     }
     
-    void update(float dt)
+    void beginFrame() { frame++; }
+    
+    void show(SDL_Renderer *ren, const StripState &s, float alpha)
     {
+        int x = (int)(s.px + (s.x - s.px)*alpha);
+        int slot = find(ren, s);
+        if (slot < 0)
+        {
+            // no render targets: draw the tiles one by one
+            for (int i = 0; i < LevelChunk::COLUMNS; i++)
+            {
+                if (s.solid[i]) tile->show(ren, 0, x + i*LevelChunk::COLUMN_W, (int)s.y);
+            }
+            return;
+        }
+        SDL_Rect dest = { x, (int)s.y, (int)LevelChunk::width(), tile->getH() };
+        batch.flush(ren);
+        SDL_RenderCopy(ren, textures[slot], NULL, &dest);
     }
     
-    void handleEvent(SDL_Event &event)
+    void destroy()
+    {
+        for (int i = 0; i < SLOTS; i++)
+        {
+            if (textures[i] != NULL) SDL_DestroyTexture(textures[i]);
+            textures[i] = NULL;
+        }
+        reset();
+    }
+    
+private:
+    // Slot holding s's chunk, baking it first if needed; -1 if it can't be
+    int find(SDL_Renderer *ren, const StripState &s)
     {
+        if (!baking) return -1;
+        int oldest = 0;
+        for (int i = 0; i < SLOTS; i++)
+        {
+            if (chunks[i] == s.chunk)
+            {
+                lastUsed[i] = frame;
+                return i;
+            }
+            if (lastUsed[i] < lastUsed[oldest]) oldest = i;
+        }
+        bake(ren, oldest, s);
+        lastUsed[oldest] = frame;
+        return oldest;
     }
     
-    void done()
+    void bake(SDL_Renderer *ren, int slot, const StripState &s)
     {
-        background.destroy();
-        Game::done();
+        batch.flush(ren);
+        SDL_SetRenderTarget(ren, textures[slot]);
+        SDL_SetRenderDrawColor(ren, 0, 0, 0, 0);
+        SDL_RenderClear(ren);
+        for (int i = 0; i < LevelChunk::COLUMNS; i++)
+        {
+            if (s.solid[i]) tile->show(ren, 0, i*LevelChunk::COLUMN_W, 0);
+        }
+        batch.flush(ren);
+        SDL_SetRenderTarget(ren, NULL);
+        SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+        chunks[slot] = s.chunk;
+        bakes++;
+    }
+};
+
+// Builds any chunk of an endless level from its index and the level seed,
+// so chunks can be thrown away and rebuilt in any order
+class LevelGenerator
+{
+    Uint32 seed;
+    Random rng;
+public:
+    Animation *brickLook, *spikeLook, *blockLook;
+    float floorHeight;
+    int safeColumns; // solid, spike-free run at the very start
+    
+    LevelGenerator()
+    {
+        seed = 1;
+        brickLook = spikeLook = blockLook = NULL;
+        floorHeight = 440.0;
+        safeColumns = 6;
+    }
+    
+    void reseed(Uint32 newSeed) { seed = newSeed; }
+    
+    void generate(LevelChunk &c, int index)
+    {
+        c.clear();
+        c.index = index;
+        c.left = index*LevelChunk::width();
+        rng.reseed(seed ^ ((Uint32)index*2654435761u));
+        
+        // floor blocks/pits in 2 block segments, one in ten a pit
+        for (int i = 0; i < LevelChunk::COLUMNS; i += 2)
+        {
+            bool solid = rng.range(10) != 0 || (index == 0 && i < safeColumns);
+            c.solid[i] = c.solid[i+1] = solid;
+        }
+        for (int i = 0; i < LevelChunk::COLUMNS; i++)
+        {
+            if (c.solid[i])
+                c.bricks.push_back(Terrain(brickLook, c.left + i*LevelChunk::COLUMN_W, floorHeight));
+        }
+        
+        // up to two spikes sitting on solid floor, at least 100px apart
+        int lastX = -1000;
+        int spikeCount = rng.range(3);
+        int start = index == 0 ? safeColumns*LevelChunk::COLUMN_W : 0;
+        int span = (int)LevelChunk::width() - spikeLook->getW() - start;
+        for (int n = 0; n < spikeCount && span > 0; n++)
+        {
+            int x = start + rng.range(span);
+            int firstCol = x / LevelChunk::COLUMN_W;
+            int lastCol = (x + spikeLook->getW() - 1) / LevelChunk::COLUMN_W;
+            if (x < lastX + 100 || !c.solid[firstCol] || !c.solid[lastCol]) continue;
+            c.spikes.push_back(Terrain(spikeLook, c.left + x, floorHeight - spikeLook->getH()));
+            lastX = x;
+            start = x + 100;
+            span = (int)LevelChunk::width() - spikeLook->getW() - start;
+        }
+        
+        // a jump block in about half the chunks
+        if (rng.range(2) == 0)
+        {
+            int x = rng.range((int)LevelChunk::width() - blockLook->getW());
+            c.jumpBlocks.push_back(Terrain(blockLook, c.left + x, rng.range(200) + 200));
+        }
+        
+        fill(c.brickGrid, c.bricks, c.left);
+        fill(c.spikeGrid, c.spikes, c.left);
+        fill(c.blockGrid, c.jumpBlocks, c.left);
+    }
+    
+private:
+    void fill(SpatialGrid &grid, LevelVector<Terrain> &pieces, float left)
+    {
+        for (unsigned int i = 0; i < pieces.size(); i++)
+            grid.insert(i, pieces[i].x - left, pieces[i].w);
     }
 };
 
@@ -434,182 +2724,364 @@ class HoppinGame:public Game
     Mix_Chunk *jumpSound;
     bool quitGame = false;
     Animation background;
-    vector<Sprite> birds, spikes, bricks, jumpBlocks;
-    Sprite cloud, happyCloud, us, rabbit;
-    SDL_Rect *rabRect = new SDL_Rect;
-    SDL_Rect *spikeRect = new SDL_Rect;
-    SDL_Rect *blockRect = new SDL_Rect;
-    SDL_Rect *floorRect = new SDL_Rect;
+    LevelVector<Sprite *> birds; // from spritePool
+    static const int LEVEL_CHUNKS = 3; // ring of chunks around the camera
+    LevelChunk chunks[LEVEL_CHUNKS];
+    int firstChunk = 0; // level index of the leftmost live chunk
+    LevelGenerator level;
+    Sprite rabbit;
+    ParallaxLayer hills, clouds; // back to front
+    float HILLS_SPEED = 50.0;  // px/s
+    float CLOUDS_SPEED = 33.0; // px/s
+    TileStrips floor; // render thread only
+    int bakedResets = 0; // renderTargetResets when the caches were last baked
+    SDL_Rect rabRect, spikeRect; // collision scratch, update thread only
     float FLOOR_HEIGHT = 440.0;
+    float CAMERA_SPEED = 150.0;  // px/s to the right through the level
+    float cameraX = 0.0, prevCameraX = 0.0; // world x at the left edge of the screen
+    LevelVector<int> candidates;
+    float prevFeet = 0.0; // bottom of the rabbit before this tick's move
+    float LANDING_SLOP = 5.0; // px the feet may already be past a top face
+    SweepAndPrune movers; // rabbit, birds and anything else free-moving
+    long moverPairs = 0, ticksRun = 0;
     int x, y;
     int dx, dy;
     bool canJump = true;
-    int stage1[1000];
-public:
-    void init(const char *gameName = "Hoppin", int maxW=MAXWIDTH, int maxH=MAXHEIGHT, int startX=100, int startY=100)
-    {
-        Game::init(gameName);
-        background.addFrame(new AnimationFrame(ren, "Img/hillbg.bmp"));
-        cloud.addFrames(ren, "Img/cloud", 1);
-        cloud.set(rand()%5+5.0, 5.0);
-        happyCloud.addFrames(ren, "Img/happycloud", 1);
-        happyCloud.set(rand()%50+350.0, rand()%20+20.0);
-        Mix_OpenAudio( 44100, MIX_DEFAULT_FORMAT, 2, 2048 ); //probably needs to be moved to media manager
-        jumpSound = Mix_LoadWAV( "/audio/jumpsound.wav" );
-        
-        for (int i=0; i < 1000; i+=2)
-        {
-            int ran = rand()%10;
-            stage1[i]=ran;          //level "blueprint" to base obstacles/danger zones on
-            stage1[i+1]=ran;        //floor blocks/ pits currently in 2 block segments
-        }
-        for (int i = 0; i < 1000; i++)
-        {
-            Sprite f;
-            f.addFrames(ren, "Img/brick",1);
-            if (stage1[i] != 0){
-                f.set(i*50, FLOOR_HEIGHT, -150.0, 0.0, 0.0, 0.0, 50, 50);
-                bricks.push_back(f);
-            }
-        }
+    SDL_Rect camera = { 0, 0, MAXWIDTH, MAXHEIGHT }; // world-space view
+    CullStats cullStats;
+    TripleBuffer<WorldSnapshot> world;
+public:
+    // Assets and layers, loaded once and kept for every restart
+    void init()
+    {
+        media.pack(ren, spriteSheet());
+        background.addFrame(framePool.make(ren, "Img/hillbg.bmp"));
+        hills.add(&background, 0, 0);
+        hills.setSpeed(HILLS_SPEED);
+        hills.bake(ren, MAXWIDTH, true);
+        clouds.add(&animations.get(animations.define(ren, "Img/cloud", 1)), rand()%5+5, 5);
+        clouds.add(&animations.get(animations.define(ren, "Img/happycloud", 1)), rand()%50+350, rand()%20+20);
+        clouds.setSpeed(CLOUDS_SPEED);
+        clouds.bake(ren, MAXWIDTH);
+        bakedResets = renderTargetResets;
+        jumpSound = media.loadSound( "audio/jumpsound.wav" );
+    
         for (int i = 0; i < 10; i++)
         {
-            Sprite b;
-            b.addFrames(ren, "Img/bird", 4);
-            b.set(rand()%maxW, rand()%20, -20.0, 0.0, 0.0, 0.0);
+            Sprite *b = spritePool.make();
+            b->setAnimation(animations.define(ren, "Img/bird", 4), rand()%400);
             birds.push_back(b);
         }
-        rabbit.addFrames(ren, "Img/rabbit", 4);
+        rabbit.setAnimation(animations.define(ren, "Img/rabbit", 4));
+    
+        level.brickLook = &animations.get(animations.define(ren, "Img/brick", 1));
+        level.spikeLook = &animations.get(animations.define(ren, "Img/spikes", 1));
+        level.blockLook = &animations.get(animations.define(ren, "Img/jumpblock", 1));
+        level.floorHeight = FLOOR_HEIGHT;
+        floor.create(ren, level.brickLook);
+    }
+    
+    // A fresh level on the loaded assets: new layout, sprites back at the
+    // start. Chunks, bodies and the snapshot buffers keep their memory.
+    void reset()
+    {
+        for (unsigned int i = 0; i < birds.size(); i++)
+            birds[i]->set(rand()%MAXWIDTH, rand()%20, -20.0, 0.0, 0.0, 0.0);
         rabbit.set(10.0, FLOOR_HEIGHT - rabbit.getH(), 0.0, 0.0, 0.0, 9.80 * pow(10, 2), 34, 78);
-        
-        int randnum1 = rand()%(640);
-        int randnum2 = randnum1;
-        Sprite s;
-        s.addFrames(ren, "Img/spikes", 1);
-        s.set(randnum1, 420.0, -150.0, 0.0, 0.0, 0.0);
-        spikes.push_back(s);
-        for (int i = 0; i < 1000; i++)
-        {
-            Sprite s;
-            randnum1 = randnum2;
-            if(!spikes.empty())
-            {
-                randnum2 = rand()%(1000*i-500) + 500;
-                if(randnum2 > randnum1 + 100)
-                {
-                    s.addFrames(ren, "Img/spikes", 1);
-                    s.set(randnum2, 420.0, -150.0, 0.0, 0.0, 0.0);
-                    spikes.push_back(s);
-                }
-            }
+        canJump = true;
+        level.reseed(rand());
+        cameraX = prevCameraX = 0.0;
+        camera.x = 0;
+        firstChunk = 0;
+        for (int i = 0; i < LEVEL_CHUNKS; i++)
+            level.generate(chunks[i], i);
+        floor.reset(); // strips were baked from the old layout
+        movers.clear();
+        movers.add(&rabbit);
+        for (unsigned int i = 0; i < birds.size(); i++)
+            movers.add(birds[i]);
+        moverPairs = ticksRun = 0;
+        cullStats.reset();
+        publish(SDL_GetPerformanceCounter());
+    }
+    
+    // Every small frame the level draws, so they all share one atlas texture
+    static vector<string> spriteSheet()
+    {
+        const char *names[] = {
+            "Img/rabbit1.bmp", "Img/rabbit2.bmp", "Img/rabbit3.bmp", "Img/rabbit4.bmp",
+            "Img/bird1.bmp", "Img/bird2.bmp", "Img/bird3.bmp", "Img/bird4.bmp",
+            "Img/brick1.bmp", "Img/spikes1.bmp", "Img/jumpblock1.bmp",
+            "Img/cloud1.bmp", "Img/happycloud1.bmp"
+        };
+        return vector<string>(names, names + sizeof(names)/sizeof(names[0]));
+    }
+    
+    // Everything init() reads, so it can be decoded ahead of time
+    static vector<string> levelImages()
+    {
+        vector<string> paths = spriteSheet();
+        paths.push_back("Img/hillbg.bmp");
+        return paths;
+    }
+    
+    static vector<string> levelSounds()
+    {
+        return vector<string>(1, "audio/jumpsound.wav");
+    }
+    
+    // Snapshot stage, on the update thread: copies out what is on screen,
+    // translating terrain through the camera. Terrain is tested against the
+    // view widened by one tick of scrolling so nothing pops at the left edge
+    // while being interpolated.
+    void publish(Uint64 tick)
+    {
+        WorldSnapshot &w = world.writeBuffer();
+        w.tick = tick;
+        w.strips.clear();
+        w.sprites.clear();
+        for (unsigned int i = 0; i < birds.size(); i++)
+            w.sprites.push_back(birds[i]->getState());
+        w.sprites.push_back(rabbit.getState());
+    
+        SDL_Rect view = camera;
+        int margin = (int)ceil(CAMERA_SPEED/tickRate) + 1;
+        view.x -= margin;
+        view.w += margin;
+        cullStats.frames++;
+        for (int n = 0; n < LEVEL_CHUNKS; n++)
+        {
+            LevelChunk &c = liveChunk(n);
+            visibleStrip(c, view, w);
+            visibleTerrain(c.jumpBlocks, view, w);
+            visibleTerrain(c.spikes, view, w);
         }
-        for (int i = 0; i < 10; i++)
+        world.publish();
+    }
+    
+    // The floor goes out as the chunk's blueprint; the render thread draws
+    // it from a baked strip, so bricks never reach the snapshot one by one
+    void visibleStrip(LevelChunk &c, const SDL_Rect &view, WorldSnapshot &w)
+    {
+        bool visible = c.left < view.x + view.w && c.left + LevelChunk::width() > view.x;
+        cullStats.count(1, visible ? 1 : 0);
+        if (!visible) return;
+        StripState s;
+        s.chunk = c.index;
+        copy(c.solid, c.solid + LevelChunk::COLUMNS, s.solid);
+        s.x = c.left - cameraX;
+        s.px = c.left - prevCameraX;
+        s.y = level.floorHeight;
+        w.strips.push_back(s);
+    }
+    
+    void visibleTerrain(LevelVector<Terrain> &pieces, const SDL_Rect &view, WorldSnapshot &w)
+    {
+        int first, last;
+        visibleRange(pieces, view, first, last);
+        for (int i = first; i < last; i++)
+            w.sprites.push_back(pieces[i].getState(cameraX, prevCameraX));
+        cullStats.count(pieces.size(), last - first);
+    }
+    
+    // n-th chunk from the left of the ring
+    LevelChunk &liveChunk(int n)
+    {
+        return chunks[(firstChunk + n) % LEVEL_CHUNKS];
+    }
+    
+    // Once the camera has fully left a chunk it is rebuilt as the next one
+    // ahead, so the level never ends and never grows
+    void streamLevel()
+    {
+        int margin = (int)ceil(CAMERA_SPEED/tickRate) + 1;
+        while (cameraX - margin >= (firstChunk + 1)*LevelChunk::width())
+        {
+            level.generate(liveChunk(0), firstChunk + LEVEL_CHUNKS);
+            firstChunk++;
+        }
+    }
+    
+    // Draw stage, on the render thread: only touches the latest snapshot.
+    // The cached scenery layers first, then everything that lives on the
+    // atlas, so the texture only changes once per frame.
+    void show(int ticks, float alpha=1.0)
+    {
+        const WorldSnapshot &w = world.read();
+        alpha = interpolation(w.tick);
+        int resets = renderTargetResets;
+        if (resets != bakedResets)
         {
-            Sprite b;
-            b.addFrames(ren, "Img/jumpblock", 1);
-            b.set(rand()%(1000*i-500) + 500, rand()%200 + 200, -150.0, 0.0, 0.0, 0.0, 50, 20);
-            jumpBlocks.push_back(b);
+            bakedResets = resets;
+            hills.bake(ren, MAXWIDTH, true);
+            clouds.bake(ren, MAXWIDTH);
+            floor.reset();
         }
+        hills.show(ren, ticks);
+        clouds.show(ren, ticks);
+        floor.beginFrame();
+        for (unsigned int i = 0; i < w.strips.size(); i++)
+            floor.show(ren, w.strips[i], alpha);
+        for (unsigned int i = 0; i < w.sprites.size(); i++)
+            w.sprites[i].show(ren, ticks, alpha);
+    }
+    
+    // One simulation tick: every object is advanced once, then collisions
+    // are resolved once against the moved world
+    void update(float dt)
+    {
+        simulate(dt);
+        resolveCollisions(dt);
     }
-    void show(int ticks)
+    
+    // Only free-moving sprites are integrated; scrolling is just the camera
+    void simulate(float dt)
     {
-        backgroundParallax(20);
-        cloudParallax(30, cloud);
-        cloudParallax(30, happyCloud);
+        prevFeet = rabbit.y() + rabbit.getH();
+        bodies.integrate(dt);
+    
         for (unsigned int i = 0; i < birds.size(); i++)
         {
-            birds[i].show(ren, ticks);
-            birds[i].update(dt);
+            if (birds[i]->x() < -birds[i]->getW()) birds[i]->moveTo(MAXWIDTH, birds[i]->y());
         }
-        rabbit.show(ren, ticks);
-        rabbit.update(dt);
-        
-        //set rect properties for collision
-        setCollision(rabRect, rabbit);
-        rabRect->y = rabbit.y + rabbit.getH() -5;
-        rabRect->h = 5; //modified hitbox
-        for (unsigned int i = 0; i < jumpBlocks.size(); i++)
-        {
-            jumpBlocks[i].show(ren, ticks);
-            jumpBlocks[i].update(dt);
-            setCollision(blockRect, jumpBlocks[i]);
-            if(SDL_HasIntersection(rabRect, blockRect))
-            {
-                rabbit.dy = 0;
-                rabbit.y = blockRect->y - rabbit.getH();
-                canJump = true;
-            }
-            for (unsigned int i = 0; i < bricks.size(); i++)
-            {
-                bricks[i].show(ren, ticks);
-                bricks[i].update(dt);
-                setCollision(floorRect, bricks[i]);
-                if(SDL_HasIntersection(rabRect, floorRect))
-                {
-                    rabbit.dy = 0;
-                    rabbit.y = floorRect->y - rabbit.getH();
-                    canJump = true;
-                }
-            }
-            for (unsigned int i = 0; i < spikes.size(); i++)
+        prevCameraX = cameraX;
+        cameraX += CAMERA_SPEED*dt;
+        camera.x = (int)cameraX;
+        streamLevel();
+    }
+    
+    // Terrain whose grid column is near the rabbit's feet, widened by how
+    // far the camera moved this tick; grids are chunk-local
+    void nearFeet(SpatialGrid &grid, float left, float slack)
+    {
+        candidates.clear();
+        grid.query(rabRect.x - left - slack, rabRect.x + rabRect.w - left + slack, candidates);
+    }
+    
+    // Fraction of this tick at which the rabbit's feet crossed the top face
+    // of s on the way down, or -1 if they didn't. The rabbit rides along
+    // with the camera, so it is moved back along both to check it overlapped
+    // s horizontally then.
+    float landingTime(Terrain &s, float dt)
+    {
+        float top = s.y;
+        float feet = rabbit.y() + rabbit.getH();
+        if (feet < top || prevFeet > top + LANDING_SLOP) return -1;
+        float t = 0.0;
+        if (feet > prevFeet) t = max(0.0f, (top - prevFeet) / (feet - prevFeet));
+        float back = dt*(1.0f - t);
+        float rx = rabbit.x() + cameraX - (rabbit.dx() + CAMERA_SPEED)*back;
+        if (rx + rabbit.getW() <= s.x || s.x + s.w <= rx) return -1;
+        return t;
+    }
+    
+    void landOn(LevelVector<Terrain> &surfaces, float dt, float &bestT, Terrain *&best)
+    {
+        for (unsigned int i = 0; i < candidates.size(); i++)
+        {
+            Terrain &s = surfaces[candidates[i]];
+            float t = landingTime(s, dt);
+            if (t >= 0 && (best == NULL || t < bestT))
             {
-                spikes[i].show(ren, ticks);
-                spikes[i].update(dt);
-                setCollision(spikeRect, spikes[i]);
-                if(SDL_HasIntersection(rabRect, spikeRect)) death();
-                if(rabbit.y >= 480) death();
+                bestT = t;
+                best = &s;
             }
         }
     }
     
-    void update(float dt)
+    // Landing is swept so a long tick can't carry the rabbit through a
+    // brick or jump block; spikes are tested against the whole span the
+    // feet covered this tick for the same reason. The rabbit is on-screen
+    // so its rect is moved into world space through the camera.
+    void resolveCollisions(float dt)
     {
-        rabbit.update(dt);
-        cloud.update(dt);
-        happyCloud.update(dt);
-        us.update(dt);
-        
-        for (unsigned int i = 0; i < birds.size(); i++)
+        //set rect properties for collision
+        setCollision(&rabRect, rabbit);
+        rabRect.x += (int)cameraX;
+        rabRect.y = rabbit.y() + rabbit.getH() -5;
+        rabRect.h = 5; //modified hitbox
+        float slack = CAMERA_SPEED*dt + 1;
+    
+        float bestT = 0.0;
+        Terrain *ground = NULL;
+        for (int n = 0; n < LEVEL_CHUNKS; n++)
         {
-            birds[i].update(dt);
-            if (birds[i].x < -birds[i].getW()) birds[i].x = MAXWIDTH;
+            LevelChunk &c = liveChunk(n);
+            nearFeet(c.blockGrid, c.left, slack);
+            landOn(c.jumpBlocks, dt, bestT, ground);
+            nearFeet(c.brickGrid, c.left, slack);
+            landOn(c.bricks, dt, bestT, ground);
         }
-        
-        for (unsigned int i = 0; i < jumpBlocks.size(); i++)
+        if (ground != NULL)
         {
-            jumpBlocks[i].update(dt);
+            rabbit.dy() = 0;
+            rabbit.y() = ground->y - rabbit.getH();
+            canJump = true;
         }
-        
-        for (unsigned int i = 0; i < bricks.size(); i++)
+    
+        float feet = rabbit.y() + rabbit.getH();
+        float sweptTop = min(prevFeet, feet) - 5;
+        rabRect.y = sweptTop;
+        rabRect.h = max(prevFeet, feet) - sweptTop;
+        for (int n = 0; n < LEVEL_CHUNKS; n++)
         {
-            bricks[i].update(dt);
+            LevelChunk &c = liveChunk(n);
+            nearFeet(c.spikeGrid, c.left, slack);
+            for (unsigned int i = 0; i < candidates.size(); i++)
+            {
+                setCollision(&spikeRect, c.spikes[candidates[i]]);
+                if(SDL_HasIntersection(&rabRect, &spikeRect)) death();
+            }
         }
-        
-        for (unsigned int i = 0; i < spikes.size(); i++)
+        if(rabbit.y() >= 480) death();
+    
+        // Mover-vs-mover candidates; nothing reacts to them yet, but new
+        // hazards only need to be added to movers and handled here
+        movers.update();
+        moverPairs += movers.getPairs().size();
+        ticksRun++;
+    }
+    
+    // Slice [first,last) of an x-sorted list whose rects overlap view
+    void visibleRange(LevelVector<Terrain> &pieces, const SDL_Rect &view, int &first, int &last)
+    {
+        int lo = 0, hi = pieces.size();
+        while (lo < hi)
         {
-            spikes[i].update(dt);
+            int mid = (lo + hi) / 2;
+            if (pieces[mid].x + pieces[mid].w <= view.x) lo = mid + 1;
+            else hi = mid;
         }
+        first = lo;
+        last = lo;
+        while (last < (int)pieces.size() && pieces[last].x < view.x + view.w)
+            last++;
     }
     
-    void setCollision(SDL_Rect *rect, Sprite s){
-        rect->x=s.x;
-        rect->y=s.y;
+    const CullStats &getCullStats() { return cullStats; }
+    
+    void setCollision(SDL_Rect *rect, const Sprite &s){
+        rect->x=s.x();
+        rect->y=s.y();
         rect->h = s.getH();
         rect->w = s.getW();
     }
-    void backgroundParallax(int rate){
-        int bgroundloc = -(ticks/rate)%background.getW();
-        background.show(ren, ticks,bgroundloc,0);
-        background.show(ren,ticks,bgroundloc+background.getW(),0);
+    void setCollision(SDL_Rect *rect, const Terrain &t){
+        rect->x=t.x;
+        rect->y=t.y;
+        rect->h = t.h;
+        rect->w = t.w;
     }
-    void cloudParallax(int rate, Sprite s){
-        int cloudloc=-(ticks/rate)%640;
-        s.Animation::show(ren,ticks,cloudloc + s.x,s.y);
-        s.Animation::show(ren,ticks,cloudloc+640 + s.x,s.y);
+    
+    void destroyAll(LevelVector<Sprite *> &sprites)
+    {
+        for (unsigned int i = 0; i < sprites.size(); i++)
+            spritePool.release(sprites[i]);
+        sprites.clear();
     }
     
     void death(){
-        finished = true;
+        finish();
     }
     void handleEvent(SDL_Event &event)
     {
@@ -617,9 +3089,9 @@ public:
         {
             if (event.key.keysym.sym == SDLK_SPACE)
             {
-                if (rabbit.dy == 0 || canJump) // Make sure rabbit can't double bounce
+                if (rabbit.dy() == 0 || canJump) // Make sure rabbit can't double bounce
                 {
-                    rabbit.dy = -500.0;
+                    rabbit.dy() = -500.0;
                     canJump = false;
                     Mix_PlayChannel( -1, jumpSound, 0);
                 }
@@ -628,7 +3100,7 @@ public:
             {
                 if (canJump)
                 {
-                    rabbit.dy = -300.0;
+                    rabbit.dy() = -300.0;
                     canJump = false;
                 }
             }
@@ -636,33 +3108,267 @@ public:
     }
     virtual bool getExitStatus(){ return quitGame; }
     
+    void run()
+    {
+        Game::run();
+        report();
+    }
+    
+    void report()
+    {
+        if (cullStats.frames > 0)
+            cout << "Objects drawn/snapshot " << (cullStats.drawn/cullStats.frames) << ", culled/snapshot " << (cullStats.culled/cullStats.frames) << endl;
+        if (ticksRun > 0)
+            cout << "Mover pairs/tick " << (float(moverPairs)/ticksRun) << endl;
+        cout << "Floor strips baked " << floor.bakes << endl;
+        cout << "Level arena " << (levelArena.reserved()/1024) << " KB in " << levelArena.getBlocks() << " block(s)" << endl;
+    }
+    
     void done()
     {
         Mix_FreeChunk( jumpSound );
-        Mix_CloseAudio();
+        hills.destroy();
+        clouds.destroy();
+        floor.destroy();
         background.destroy();
+        destroyAll(birds);
+        for (int i = 0; i < LEVEL_CHUNKS; i++)
+            chunks[i].clear();
+        bodies.clear();
         Game::done();
     }
 };
 
-int main(int argc, char **argv)
+// Lives as long as the process: owns the window, renderer and audio device,
+// and with them the texture cache. Each scene is loaded the first time it
+// is played and only reset after that, so going round the start screen and
+// the level again never recreates the window or reloads a texture.
+class Engine
 {
-    while (endGame == false)
+    SDL_Window *win;
+    SDL_Renderer *ren;
+    bool audio;
+    vector<Game *> scenes; // loaded so far, oldest first
+public:
+    Engine() : win(NULL), ren(NULL), audio(false) {}
+    
+    bool open(const char *gameName, int maxW=MAXWIDTH, int maxH=MAXHEIGHT)
     {
-        if (endGame == false)
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
         {
-            StartGame s;
-            s.init();
-            s.run();
-            s.done();
+            cout << "SDL_Init Error: " << SDL_GetError() << endl;
+            return false;
         }
-        if (endGame == false)
+        
+        win = SDL_CreateWindow(gameName, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, maxW, maxH, SDL_WINDOW_SHOWN);
+        if (win == NULL)
+        {
+            cout << "SDL_CreateWindow Error: " << SDL_GetError() << endl;
+            SDL_Quit();
+            return false;
+        }
+        
+        ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        if (ren == NULL)
+        {
+            cout << "SDL_CreateRenderer Error: " << SDL_GetError() << endl;
+            SDL_DestroyWindow(win);
+            win = NULL;
+            SDL_Quit();
+            return false;
+        }
+        
+        // the game still runs silently without a mixer
+        audio = Mix_OpenAudio(AUDIO_RATE, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, 2048) == 0;
+        if (!audio)
+            cout << "Mix_OpenAudio Error: " << SDL_GetError() << endl;
+        return true;
+    }
+    
+    void play(Game &scene)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (find(scenes.begin(), scenes.end(), &scene) == scenes.end())
+        {
+            scene.attach(win, ren);
+            scene.init();
+            scenes.push_back(&scene);
+        }
+        scene.reset();
+        cout << "Scene ready in " << (SDL_GetPerformanceCounter() - start)*1000.0/SDL_GetPerformanceFrequency() << " ms" << endl;
+        scene.run();
+    }
+    
+    // Scenes newest first, then everything they allocated in one step,
+    // then the devices
+    void close()
+    {
+        for (int i = (int)scenes.size() - 1; i >= 0; i--)
+            scenes[i]->done();
+        scenes.clear();
+        media.stopLoading();
+        animations.clear();
+        media.clear();
+        framePool.reset();
+        animationPool.reset();
+        spritePool.reset();
+        levelArena.reset();
+        if (audio) Mix_CloseAudio();
+        audio = false;
+        if (ren != NULL) SDL_DestroyRenderer(ren);
+        if (win != NULL) SDL_DestroyWindow(win);
+        ren = NULL;
+        win = NULL;
+        SDL_Quit();
+    }
+};
+
+Engine engine;
+
+const char *BUNDLE_PATH = "Hoppin.pak";
+
+// hoppin --pack [file] converts the loose assets into a bundle and exits
+int packAssets(const char *path)
+{
+    vector<string> images = HoppinGame::levelImages();
+    images.push_back("Img/startscreen1.bmp");
+    images.push_back("Img/startscreen2.bmp");
+    return AssetBundle::write(path, images, HoppinGame::levelSounds()) ? 0 : 1;
+}
+
+// hoppin --bench-colorkey times SDL's colour key and conversion against
+// the PixelConverter kernels on a screen-sized image of each layout
+double benchSeconds(Uint64 start)
+{
+    return double(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+}
+
+int benchColorKey()
+{
+    const int W = 640, H = 480, RUNS = 50;
+    const Uint32 formats[2] = { SDL_PIXELFORMAT_BGR24, SDL_PIXELFORMAT_RGBA8888 };
+    const char *formatNames[2] = { "BGR24", "RGBA8888" };
+    PixelConverter::BgrKernel bgrKernels[4] = { PixelConverter::bgrRowScalar, PixelConverter::bgrRowScalar, PixelConverter::bgrRowScalar, PixelConverter::bgrRowScalar };
+    PixelConverter::RgbaKernel rgbaKernels[4] = { PixelConverter::rgbaRowScalar, PixelConverter::rgbaRowScalar, PixelConverter::rgbaRowScalar, PixelConverter::rgbaRowScalar };
+    const char *names[4] = { "scalar", "SSE2", "SSSE3", "AVX2" };
+    bool usable[4] = { true, false, false, false };
+#ifdef HOPPIN_X86
+    usable[1] = SDL_HasSSE2() == SDL_TRUE;
+    usable[2] = SDL_HasSSSE3() == SDL_TRUE;
+    usable[3] = SDL_HasAVX2() == SDL_TRUE;
+    rgbaKernels[1] = PixelConverter::rgbaRowSSE2;
+    bgrKernels[2] = PixelConverter::bgrRowSSSE3;
+    rgbaKernels[2] = PixelConverter::rgbaRowSSE2;
+    bgrKernels[3] = PixelConverter::bgrRowAVX2;
+    rgbaKernels[3] = PixelConverter::rgbaRowAVX2;
+#endif
+    Random random;
+    int mismatches = 0;
+    for (int f = 0; f < 2; f++)
+    {
+        SDL_Surface *src = SDL_CreateRGBSurfaceWithFormat(0, W, H, 0, formats[f]);
+        SDL_Surface *out = SDL_CreateRGBSurfaceWithFormat(0, W, H, 32, SDL_PIXELFORMAT_ARGB8888);
+        SDL_Surface *expect = SDL_CreateRGBSurfaceWithFormat(0, W, H, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (src == NULL || out == NULL || expect == NULL)
+        {
+            cout << "SDL_CreateRGBSurfaceWithFormat Error: " << SDL_GetError() << endl;
+            SDL_FreeSurface(src); SDL_FreeSurface(out); SDL_FreeSurface(expect);
+            return 1;
+        }
+        // noise with a run of key green every few pixels, like the sprites
+        SDL_LockSurface(src);
+        for (int y = 0; y < H; y++)
+        {
+            Uint8 *row = (Uint8 *)src->pixels + y*src->pitch;
+            for (int x = 0; x < W; x++)
+            {
+                Uint32 c = random.range(7) < 3 ? 0x0000ff00 : random.next() & 0x00ffffff;
+                if (f == 0) { row[3*x] = Uint8(c); row[3*x + 1] = Uint8(c >> 8); row[3*x + 2] = Uint8(c >> 16); }
+                else ((Uint32 *)row)[x] = c << 8 | (random.next() & 0xff);
+            }
+        }
+        SDL_UnlockSurface(src);
+        
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int r = 0; r < RUNS; r++)
+        {
+            SDL_SetColorKey(src, SDL_TRUE, SDL_MapRGB(src->format, 0, 255, 0));
+            SDL_Surface *converted = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888, 0);
+            SDL_FreeSurface(converted);
+        }
+        SDL_SetColorKey(src, SDL_FALSE, 0);
+        double sdlTime = benchSeconds(start);
+        cout << formatNames[f] << " " << W << "x" << H << ", " << RUNS << " runs" << endl;
+        cout << "  SDL key + convert  " << (sdlTime*1000/RUNS) << " ms" << endl;
+        
+        for (int k = 0; k < 4; k++)
         {
-            HoppinGame g;
-            g.init();
-            g.run();
-            g.done();
+            // a level with no kernel of its own for this layout is skipped
+            bool same = k > 0 && (f == 0 ? bgrKernels[k] == bgrKernels[k - 1] : rgbaKernels[k] == rgbaKernels[k - 1]);
+            if (!usable[k] || same) continue;
+            SDL_Surface *target = k == 0 ? expect : out;
+            start = SDL_GetPerformanceCounter();
+            for (int r = 0; r < RUNS; r++)
+            {
+                for (int y = 0; y < H; y++)
+                {
+                    const Uint8 *in = (const Uint8 *)src->pixels + y*src->pitch;
+                    Uint32 *row = (Uint32 *)((Uint8 *)target->pixels + y*target->pitch);
+                    if (f == 0) bgrKernels[k](in, row, W);
+                    else rgbaKernels[k]((const Uint32 *)in, row, W);
+                }
+            }
+            double time = benchSeconds(start);
+            int wrong = 0;
+            for (int y = 0; k > 0 && y < H; y++)
+                if (memcmp((Uint8 *)out->pixels + y*out->pitch, (Uint8 *)expect->pixels + y*expect->pitch, W*4) != 0)
+                    wrong++;
+            mismatches += wrong;
+            cout << "  " << names[k] << string(18 - strlen(names[k]), ' ') << (time*1000/RUNS) << " ms, "
+                 << (sdlTime/time) << "x SDL" << (wrong > 0 ? ", MISMATCHED ROWS " : "");
+            if (wrong > 0) cout << wrong;
+            cout << endl;
+        }
+        SDL_FreeSurface(src);
+        SDL_FreeSurface(out);
+        SDL_FreeSurface(expect);
+    }
+    return mismatches == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    PixelConverter::selectKernel();
+    if (argc > 1 && strcmp(argv[1], "--pack") == 0)
+        return packAssets(argc > 2 ? argv[2] : BUNDLE_PATH);
+    if (argc > 1 && strcmp(argv[1], "--bench-colorkey") == 0)
+        return benchColorKey();
+    // --fps display (default), --fps uncapped or --fps <Hz>
+    FramePacer::Mode pacing = FramePacer::DISPLAY;
+    int fps = 0;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--fps") != 0) continue;
+        if (strcmp(argv[i + 1], "uncapped") == 0) pacing = FramePacer::UNCAPPED;
+        else if (atoi(argv[i + 1]) > 0)
+        {
+            pacing = FramePacer::FIXED;
+            fps = atoi(argv[i + 1]);
         }
     }
+    KinematicsStore::selectKernel();
+    media.openBundle(BUNDLE_PATH);
+    if (!engine.open("Hoppin")) return 1;
+    media.prefetch(HoppinGame::levelImages()); // decoded while the start screen shows
+    StartGame start;
+    HoppinGame level;
+    level.setFrameRate(pacing, fps);
+    while (endGame == false)
+    {
+        engine.play(start);
+        if (endGame == false)
+            engine.play(level);
+    }
+    engine.close();
     return 0;
 }